@@ -11,7 +11,7 @@ let host = '10.0.0.10'
 let port = 6666
 let nick = ''
 
-let nickInput, addrInput, connectButton
+let nickInput, addrInput, connectButton, watchButton
 let myFont
 
 const angleSpeed = 0.003
@@ -24,6 +24,10 @@ const mapZoomInit = 2
 const mapZoom = mapZoomInit
 const mapFog = 800
 const pelletAngleSpeed = 0.002
+// Throttled links only get nearby ships, and nothing tells us when one
+// drifts out of range, so ships we stop hearing about are hidden after a few
+// of the slowest snapshot intervals.
+const shipExpire = 1500
 
 let stars = []
 let logs = []
@@ -40,6 +44,8 @@ let maxTx = 0, maxTy = 0
 // global game state
 let connected = false
 let joined = false
+// spectating without a ship, the only way in through a relay
+let watching = false
 let gameOver = false
 let winningId = -1
 let lastPing = -1
@@ -50,6 +56,10 @@ let starCount = mapSize / 5
 let untilReset = 0
 let untilStop = 0
 
+// server game clock, and when we last heard it
+let serverClock = 0
+let serverClockAt = 0
+
 let pellets = {}
 let bullets = {}
 let rocks = {}
@@ -96,6 +106,10 @@ function onMessage(text) {
   lastPing = millis()
   if (msg[0] == 'pong') {
 
+  } else if (msg[0] == 'ping') {
+    // The server times its own pings, hand the stamp straight back.
+    sendMessage(`pong,${msg[1]}`)
+
   } else if (msg[0] == 'got-hit') {
     screenShake.toggle()
 
@@ -115,6 +129,7 @@ function onMessage(text) {
     mapSize = num(msg[9])
     untilReset = num(msg[10])
     untilStop = num(msg[11])
+    setClock(num(msg[13]))
 
     joined = true
 
@@ -123,6 +138,7 @@ function onMessage(text) {
     untilReset = Math.max(num(msg[2]), 0)
     untilStop = Math.max(num(msg[3]), 0)
     gameOver = num(msg[4]) === 1
+    setClock(num(msg[5]))
 
   } else if (msg[0] == 'stat-ship') {
     const id = num(msg[1])
@@ -137,6 +153,7 @@ function onMessage(text) {
       if (!(id in ships)) ships[id] = new Ship(id)
       const ship = ships[id]
 
+      ship.heardAt = millis()
       ship.x = dint(msg[2])
       ship.y = dint(msg[3])
       ship.angle = dint(msg[4])
@@ -160,6 +177,43 @@ function onMessage(text) {
     if (!('angleSpeed' in rock)) rock.angleSpeed = randomGaussian(0, 0.0001)
     if (!('vertices' in rock)) rock.vertices = randomPolygon(rock.size)
 
+  } else if (msg[0] == 'new-rock') {
+    const id = num(msg[1])
+    if (!(id in rocks)) rocks[id] = new Rock(id)
+    const rock = rocks[id]
+
+    rock.sim = true
+    rock.x0 = dint(msg[2])
+    rock.y0 = dint(msg[3])
+    rock.t0 = num(msg[4])
+    rock.angle = dint(msg[5])
+    rock.speed = dint(msg[6])
+    rock.size = num(msg[7])
+    rock.health = num(msg[8])
+    rock.update()
+
+    if (!('angleSpeed' in rock)) rock.angleSpeed = randomGaussian(0, 0.0001)
+    if (!('vertices' in rock)) rock.vertices = randomPolygon(rock.size)
+
+  } else if (msg[0] == 'new-bullet') {
+    const id = num(msg[1])
+    const pid = num(msg[2])
+    if (!(id in bullets)) bullets[id] = new Bullet(id, pid)
+    const bullet = bullets[id]
+
+    bullet.sim = true
+    bullet.x0 = dint(msg[3])
+    bullet.y0 = dint(msg[4])
+    bullet.t0 = num(msg[5])
+    bullet.angle = dint(msg[6])
+    bullet.update()
+
+  } else if (msg[0] == 'sum-world') {
+    checkWorldSum(num(msg[1]), num(msg[2]), num(msg[3]), num(msg[4]), num(msg[5]))
+
+  } else if (msg[0] == 'sync-world') {
+    // marks a relay's resync, the entities follow in the same frame
+
   } else if (msg[0] == 'stat-bullet') {
     const id = num(msg[1])
     const pid = num(msg[2])
@@ -226,6 +280,34 @@ function onMessage(text) {
   if (mapSize != oldMapSize) windowResized()
 }
 
+function setClock(clock) {
+  serverClock = clock
+  serverClockAt = millis()
+}
+
+function gameClock() {
+  return serverClock + millis() - serverClockAt
+}
+
+// Rocks and bullets we got as spawn records are simulated here, and the
+// server only tells us about hits. Every so often it sends a sum of the ids
+// it has at a given clock; if ours differs we start over from a full resync.
+function checkWorldSum(clock, rockCount, rockSum, bulletCount, bulletSum) {
+  if (!joined) return
+  for (const id in bullets) {
+    const bullet = bullets[id]
+    if (bullet.sim && clock - bullet.t0 > bulletDecay) delete bullets[id]
+  }
+
+  if (idSum(rocks) == rockSum && Object.keys(rocks).length == rockCount &&
+      idSum(bullets) == bulletSum && Object.keys(bullets).length == bulletCount) return
+
+  console.log('world diverged, resyncing')
+  rocks = {}
+  bullets = {}
+  sendMessage('usr-resync')
+}
+
 function shootBullet () {
   sendMessage(`usr-fired,${myId},${eint(myShip.x)},${eint(myShip.y)},${eint(myShip.angle)}`)
 }
@@ -284,11 +366,13 @@ class Pellet {
     push()
     translate(this.x, this.y)
     rotate(pelletAngle)
+    // Merged pellets are worth more, draw them a little bigger.
+    const r = 2 + Math.min(this.value - 1, 3)
     if (this.type == 1) {
       stroke(60, 100, 100)
-      rect(-2, -2, 4, 4)
+      rect(-r, -r, 2 * r, 2 * r)
     } else {
-      rect(-2, -2, 4, 4)
+      rect(-r, -r, 2 * r, 2 * r)
     }
     pop()
   }
@@ -301,12 +385,19 @@ class Bullet {
   }
 
   update() {
+    if (this.sim) {
+      this.time = gameClock() - this.t0
+      this.x = this.x0 + this.time * bulletSpeed * Math.cos(this.angle)
+      this.y = this.y0 + this.time * bulletSpeed * Math.sin(this.angle)
+      return
+    }
     this.x += dt * bulletSpeed * Math.cos(this.angle)
     this.y += dt * bulletSpeed * Math.sin(this.angle)
     this.time += dt
   }
 
   draw() {
+    if (this.time > bulletDecay) return
     if (outsideView(this)) return
     push()
     fill(0)
@@ -323,6 +414,12 @@ class Rock {
 
   update() {
     //this.angle += dt * this.angleSpeed
+    if (this.sim) {
+      const elapsed = gameClock() - this.t0
+      this.x = this.x0 + elapsed * this.speed * Math.cos(this.angle)
+      this.y = this.y0 + elapsed * this.speed * Math.sin(this.angle)
+      return
+    }
     this.x += dt * this.speed * Math.cos(this.angle)
     this.y += dt * this.speed * Math.sin(this.angle)
   }
@@ -345,6 +442,7 @@ class Ship {
   constructor(id) {
     this.visible = true
     this.id = id
+    this.heardAt = millis()
   }
 
   update() {
@@ -352,6 +450,7 @@ class Ship {
 
   draw() {
     if (!this.visible) return
+    if (millis() - this.heardAt > shipExpire) return
     if (outsideView(this)) return
     push()
     translate(this.x, this.y)
@@ -368,6 +467,27 @@ class Ship {
   }
 }
 
+// Stands in for our ship while spectating, the arrow keys pan the view.
+class Camera {
+  constructor() {
+    this.x = mapSize / 2
+    this.y = mapSize / 2
+  }
+
+  update() {
+    const speed = 3 * moveSpeed
+    if (keyIsDown(LEFT_ARROW)) this.x -= dt * speed
+    if (keyIsDown(RIGHT_ARROW)) this.x += dt * speed
+    if (keyIsDown(UP_ARROW)) this.y -= dt * speed
+    if (keyIsDown(DOWN_ARROW)) this.y += dt * speed
+    this.x = clip(this.x, 0, mapSize)
+    this.y = clip(this.y, 0, mapSize)
+  }
+
+  draw() {
+  }
+}
+
 class MyShip {
   constructor(id) {
     this.id = id
@@ -443,8 +563,10 @@ const loginView = {
   connTime: 0,
 
   onShow() {
-    connectButton.mousePressed(() => this.onConnect());
+    connectButton.mousePressed(() => this.onConnect(false));
     connectButton.show()
+    watchButton.mousePressed(() => this.onConnect(true));
+    watchButton.show()
     addrInput.show()
     nickInput.show()
     logs = []
@@ -455,6 +577,7 @@ const loginView = {
     this.connTime = 0;
     this.message = ''
     connectButton.hide()
+    watchButton.hide()
     addrInput.hide()
     nickInput.hide()
     logs = []
@@ -462,10 +585,11 @@ const loginView = {
   },
 
   keyPressed() {
-    if (keyCode == 13 /* enter */) this.onConnect()
+    if (keyCode == 13 /* enter */) this.onConnect(false)
   },
 
-  onConnect() {
+  onConnect(watch) {
+    watching = watch
     this.connecting = true
     this.connTime = 0
     this.message = 'connecting...'
@@ -480,7 +604,7 @@ const loginView = {
     socket = new Net.Socket()
 
     socket.connect({host: host, port: port}, () => {
-      sendMessage("conn")
+      sendMessage(watching ? "conn,watch" : "conn,sim")
       connected = true
     })
 
@@ -503,7 +627,7 @@ const loginView = {
   update() {
     if (this.connecting) {
       syncConnection()
-      if (connected) segueTo(lobbyView)
+      if (connected) segueTo(watching ? watchView : lobbyView)
       this.connTime += deltaTime
       if (this.connTime > this.connTimeout) this.onTimeout()
     }
@@ -545,7 +669,7 @@ const lobbyView = {
 
   keyPressed() {
     if (keyCode == 13 /* enter */) {
-      sendMessage(`conn`)
+      sendMessage(`conn,sim`)
       sendMessage(`join,${nick}`)
     }
   },
@@ -652,6 +776,50 @@ COORDS ${round(myShip.x)} X ${round(myShip.y)}`
 }
 
 
+// Relays only pass the world on, so nobody joins from here.
+const watchView = {
+  onShow() {
+    myShip = new Camera()
+    generateStars()
+  },
+
+  onExit() {
+    resetGame()
+  },
+
+  update() {
+    syncConnection()
+
+    updateViewport()
+
+    pelletAngle += dt * pelletAngleSpeed
+    myShip.update()
+    for (const id in pellets) pellets[id].update()
+    for (const id in bullets) bullets[id].update()
+    for (const id in rocks) rocks[id].update()
+    for (const id in ships) ships[id].update()
+
+    if (!connected) {
+      loginView.message = 'disconnected from server'
+      segueTo(loginView)
+    }
+  },
+
+  draw() {
+    gameView.draw()
+  },
+
+  drawUI() {
+    drawTimer()
+    drawText('spectating', 20, 35, myFont, 24, LEFT)
+    drawText('arrow keys to look around', 20, 60, 'monospace', 18, LEFT)
+
+    drawText('captain\'s log', windowWidth - 20, 35, myFont, 24, RIGHT)
+    drawText(logs.join('\n'), windowWidth -20, 57, 'monospace', 18, RIGHT)
+  },
+}
+
+
 // ----------------------------------------------------------------------------
 // -- P5 callbacks
 // ----------------------------------------------------------------------------
@@ -667,6 +835,7 @@ function windowResized() {
   nickInput.position(windowWidth/2 - 170, windowHeight/2 - 50)
   addrInput.position(windowWidth/2 - 170, windowHeight/2 - 0)
   connectButton.position(windowWidth/2 - 170, windowHeight/2 + 50)
+  watchButton.position(windowWidth/2 - 170, windowHeight/2 + 90)
 
   cx = windowWidth / 2 / mapZoom
   cy = windowHeight / 2 / mapZoom
@@ -687,6 +856,7 @@ function setup() {
   nickInput = createInput(nick);
   addrInput = createInput(host+':'+port);
   connectButton = createButton('CONNECT');
+  watchButton = createButton('WATCH');
 
   windowResized()
   generateStars()
@@ -17,6 +17,13 @@ function distsq(a, b) {
   return dx * dx + dy * dy
 }
 
+// Same order-independent id hash the server uses for world sums.
+function idSum(objs) {
+  let sum = 0
+  for (const id in objs) sum = (sum + Math.imul(Number(id), 2654435761)) >>> 0
+  return sum
+}
+
 function clip(x, lower, upper) {
   return Math.max(Math.min(x, upper), lower)
 }
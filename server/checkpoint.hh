@@ -0,0 +1,235 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <type_traits>
+
+#include "game.hh"
+
+//
+// Checkpoint format
+//
+
+// A checkpoint is a flat little-endian byte stream: a header with the
+// match settings, then every table as (next_id, count, items...). Plain
+// structs are stored as raw bytes, tagged with their size so a binary with a
+// different layout refuses the checkpoint instead of misreading it.
+
+const u32 checkpoint_magic = 0x59584c47; // "GLXY"
+const u32 checkpoint_version = 7;
+
+struct Writer {
+    string data;
+
+    template <class T>
+    inline void put(const T &value) {
+        static_assert(is_trivially_copyable<T>::value, "put needs a plain type");
+        data.append((const char *) &value, sizeof(T));
+    }
+
+    inline void put(const string &value) {
+        put((u32) value.size());
+        data += value;
+    }
+};
+
+struct Reader {
+    const u8 *at;
+    const u8 *end;
+
+    template <class T>
+    inline T get() {
+        static_assert(is_trivially_copyable<T>::value, "get needs a plain type");
+        if (end - at < (i64) sizeof(T)) throw "truncated checkpoint";
+        T value;
+        memcpy(&value, at, sizeof(T));
+        at += sizeof(T);
+        return value;
+    }
+
+    inline string get_string() {
+        u32 length = get<u32>();
+        if (end - at < length) throw "truncated checkpoint";
+        string value((const char *) at, length);
+        at += length;
+        return value;
+    }
+};
+
+template <class Item>
+inline void save_item(Writer &out, const Item &item) {
+    out.put(item);
+}
+
+template <class Item>
+inline Item load_item(Reader &in) {
+    return in.get<Item>();
+}
+
+template <class Item>
+inline void save_table(Writer &out, const Table<Item> &table) {
+    out.put(table.next_id);
+    out.put((u32) table.data.size());
+    for (auto const& [id, item] : table.data) save_item(out, item);
+}
+
+template <class Item>
+inline void load_table(Reader &in, Table<Item> &table) {
+    table.data.clear();
+    table.next_id = in.get<i32>();
+    u32 count = in.get<u32>();
+    for (u32 i = 0; i < count; i++) {
+        Item item = load_item<Item>(in);
+        table.data[item.id] = item;
+    }
+}
+
+inline void save_item(Writer &out, const Player &player) {
+    out.put(player.id); out.put(player.x); out.put(player.y); out.put(player.angle);
+    out.put(player.spice); out.put(player.energy);
+    out.put(player.shield); out.put(player.shield_time); out.put(player.shield_decay);
+    out.put(player.nick); out.put(player.game_over); out.put(player.fd);
+}
+
+template <>
+inline Player load_item<Player>(Reader &in) {
+    Player player;
+    player.id = in.get<i32>(); player.x = in.get<i32>(); player.y = in.get<i32>(); player.angle = in.get<i32>();
+    player.spice = in.get<i32>(); player.energy = in.get<i32>();
+    player.shield = in.get<i32>(); player.shield_time = in.get<i32>(); player.shield_decay = in.get<i32>();
+    player.nick = in.get_string(); player.game_over = in.get<bool>(); player.fd = in.get<i32>();
+    return player;
+}
+
+inline void save_game(Writer &out, const Game &game) {
+    out.put(checkpoint_magic);
+    out.put(checkpoint_version);
+    out.put((u32) sizeof(Rock));
+    out.put((u32) sizeof(Bullet));
+    out.put((u32) sizeof(Pellet));
+
+    out.put(map_size);
+    out.put(game_time);
+    out.put(reset_time);
+    out.put(world_seed);
+    stringstream rng;
+    rng << gen;
+    out.put(rng.str());
+
+    out.put(game.finished);
+    out.put(game.reset);
+    out.put(game.clock);
+    out.put(game.seed);
+    out.put(game.until_stop);
+    out.put(game.until_reset);
+    out.put(game.until_reset_max);
+
+    save_table(out, game.players);
+    save_table(out, game.rocks);
+    save_table(out, game.bullets);
+    save_table(out, game.pellets);
+
+    out.put((u32) game.regions.size());
+    for (auto const& [key, region] : game.regions) {
+        out.put(key);
+        out.put(region.rng);
+        out.put(region.target);
+        out.put(region.asleep);
+        out.put(region.respawn);
+        out.put(region.awake);
+        out.put(region.generated);
+    }
+}
+
+// Restores the settings globals too, the match keeps the ones it started with.
+inline Game load_game(Reader &in) {
+    if (in.get<u32>() != checkpoint_magic) throw "not a checkpoint";
+    if (in.get<u32>() != checkpoint_version) throw "unsupported checkpoint version";
+    if (in.get<u32>() != sizeof(Rock) || in.get<u32>() != sizeof(Bullet) || in.get<u32>() != sizeof(Pellet))
+        throw "checkpoint from an incompatible build";
+
+    map_size = in.get<i32>();
+    game_time = in.get<i32>();
+    reset_time = in.get<i32>();
+    world_seed = in.get<u64>();
+    stringstream rng(in.get_string());
+    rng >> gen;
+
+    Game game(game_time, reset_time);
+    game.finished = in.get<bool>();
+    game.reset = in.get<bool>();
+    game.clock = in.get<i32>();
+    game.seed = in.get<u64>();
+    game.until_stop = in.get<i32>();
+    game.until_reset = in.get<i32>();
+    game.until_reset_max = in.get<i32>();
+
+    load_table(in, game.players);
+    load_table(in, game.rocks);
+    load_table(in, game.bullets);
+    load_table(in, game.pellets);
+
+    u32 count = in.get<u32>();
+    for (u32 i = 0; i < count; i++) {
+        Region &region = game.regions[in.get<i32>()];
+        region.rng = in.get<SplitMix>();
+        region.target = in.get<i32>();
+        region.asleep = in.get<i32>();
+        region.respawn = in.get<i32>();
+        region.awake = in.get<bool>();
+        region.generated = in.get<bool>();
+    }
+    for (auto const& [id, rock] : game.rocks.data) game.regions[rock.region].rocks.insert(id);
+    for (auto const& [id, pellet] : game.pellets.data) game.regions[pellet.region].pellets.insert(id);
+    game.plan_all();
+    return game;
+}
+
+
+//
+// Mapped files
+//
+
+inline bool write_mapped(const string &path, const string &data) {
+    i32 fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) return false;
+    if (ftruncate(fd, data.size()) < 0) {
+        close(fd);
+        return false;
+    }
+    void *map = mmap(nullptr, data.size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+    memcpy(map, data.data(), data.size());
+    munmap(map, data.size());
+    return true;
+}
+
+struct MappedFile {
+    const u8 *data = nullptr;
+    u64 size = 0;
+
+    inline bool open(const string &path) {
+        i32 fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, &info) < 0 || info.st_size == 0) {
+            close(fd);
+            return false;
+        }
+        void *map = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) return false;
+        data = (const u8 *) map;
+        size = info.st_size;
+        return true;
+    }
+
+    inline Reader reader() const {
+        return Reader{data, data + size};
+    }
+
+    inline ~MappedFile() {
+        if (data) munmap((void *) data, size);
+    }
+};
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "util.hh"
+
+//
+// Fixed-point geometry
+//
+
+// Positions are in milli-units and angles in milliradians, all i32. Trig
+// results are Q16 (1.0 == fix_one) and come from tables built at compile
+// time, so the simulation gives the same answer on every platform.
+
+const i32 fix_shift = 16;
+const i32 fix_one = 1 << fix_shift;
+
+// Milliradians in a full turn, and in a quarter of one.
+const i32 turn_milli = 6283;
+const i32 quarter_milli = 1571;
+
+constexpr f64 taylor_sin(f64 x) {
+    const f64 pi = 3.14159265358979323846;
+    while (x > pi) x -= 2 * pi;
+    while (x < -pi) x += 2 * pi;
+    f64 term = x, sum = x;
+    for (i32 n = 1; n < 12; n++) {
+        term *= -x * x / ((2 * n) * (2 * n + 1));
+        sum += term;
+    }
+    return sum;
+}
+
+struct SineTable {
+    i32 value[turn_milli];
+
+    constexpr SineTable() : value() {
+        for (i32 i = 0; i < turn_milli; i++) {
+            f64 v = taylor_sin(i / 1000.0) * fix_one;
+            value[i] = (i32)(v < 0 ? v - 0.5 : v + 0.5);
+        }
+    }
+};
+
+constexpr SineTable sine_table{};
+
+inline i32 fsin(i32 angle) {
+    i32 i = angle % turn_milli;
+    if (i < 0) i += turn_milli;
+    return sine_table.value[i];
+}
+
+inline i32 fcos(i32 angle) {
+    return fsin(angle % turn_milli + quarter_milli);
+}
+
+// Distance covered in dt millis at speed milli-units per milli along an axis
+// whose Q16 trig factor is given, rounded to the nearest milli-unit.
+inline i32 advance(i32 dt, i32 speed, i32 trig) {
+    return (i32)(((i64)dt * speed * trig + (fix_one >> 1)) >> fix_shift);
+}
+
+// Square root rounded down, by the digit-by-digit method so it's exact for
+// values past what a double can hold.
+inline i128 isqrt(i128 n) {
+    i128 root = 0, bit = (i128)1 << 124;
+    while (bit > n) bit >>= 2;
+    while (bit != 0) {
+        if (n >= root + bit) {
+            n -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return root;
+}
+
+inline i64 idistsq(i32 x1, i32 y1, i32 x2, i32 y2) {
+    i64 dx = (i64)x2 - x1;
+    i64 dy = (i64)y2 - y1;
+    return dx*dx + dy*dy;
+}
+
+inline bool within(i32 x1, i32 y1, i32 x2, i32 y2, i32 radius) {
+    return idistsq(x1, y1, x2, y2) < (i64)radius * radius;
+}
+
+template <i32 Radius>
+inline bool within(i32 x1, i32 y1, i32 x2, i32 y2) {
+    constexpr i64 radius_sq = (i64)Radius * Radius;
+    return idistsq(x1, y1, x2, y2) < radius_sq;
+}
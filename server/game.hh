@@ -1,6 +1,10 @@
 #pragma once
 
+#include <queue>
+#include <unordered_map>
+
 #include "util.hh"
+#include "fixed.hh"
 
 const i32 bullet_speed = 0.3*1000;
 const i32 bullet_decay = 1000*1;
@@ -10,6 +14,21 @@ const i32 init_angle = -PI/2*1000;
 i32 game_time = 5*60 * 1000;
 i32 reset_time = 30 * 1000;
 i32 map_size = 4 * 1000;
+u64 world_seed = random_device{}();
+
+// The map is split into square regions whose rocks are generated from the
+// world seed the first time a player comes near, and dropped again once no
+// one has been around for a while.
+const i32 region_size = 500*1000;
+const i32 region_wake = 2;
+const i32 region_evict = 30*1000;
+const i32 region_respawn = 2*1000;
+
+// Pellets fade after a while, and one dropped close to a pellet of the same
+// type folds into it, so a region never holds more than pellet_cap of them.
+const i32 pellet_lifetime = 60*1000;
+const i32 pellet_merge = 6*1000;
+const u32 pellet_cap = 64;
 
 struct Player {
     i32 id, x, y, angle, spice, energy, shield, shield_time, shield_decay;
@@ -20,49 +39,142 @@ struct Player {
     void enable_shield(i32 decay);
     void update_shield(i32 dt);
 
-    inline string encode() const {
-        return S(id)+","+S(x)+","+S(y)+","+S(angle)+","+S(spice)+","+S(energy)+","+S(shield)+","+S(game_over);
-    }
-
     inline void update(i32 dt) {
         update_shield(dt);
     }
 };
 
+// Rocks and bullets fly in a straight line from where they spawned, so their
+// position is a function of the game clock and anyone holding the spawn
+// record (x0, y0, t0) can work it out without further updates.
+
 struct Rock {
     i32 id, x, y, angle, speed, size, health;
+    i32 region = -1;
+    // Leaving the world this tick, nothing should aim at it any more.
     bool disable = false;
+    i32 x0 = 0, y0 = 0, t0 = 0;
 
-    inline string encode() const {
-        return S(id)+","+S(x)+","+S(y)+","+S(angle)+","+S(speed)+","+S(size)+","+S(health);
-    }
-
-    inline void update(i32 dt) {
-        x += dt * speed * cos(angle / 1000.0);
-        y += dt * speed * sin(angle / 1000.0);
+    inline void update(i32 clock) {
+        x = x0 + advance(clock - t0, speed, fcos(angle));
+        y = y0 + advance(clock - t0, speed, fsin(angle));
     }
 };
 
 struct Bullet {
     i32 id, pid, x, y, angle, time;
+    i32 x0 = 0, y0 = 0, t0 = 0;
 
-    inline string encode() const {
-        return S(id)+","+S(pid)+","+S(x)+","+S(y)+","+S(angle)+","+S(time);
+    inline void update(i32 clock) {
+        time = clock - t0;
+        x = x0 + advance(time, bullet_speed, fcos(angle));
+        y = y0 + advance(time, bullet_speed, fsin(angle));
     }
+};
 
-    inline void update(i32 dt) {
-        x += dt * bullet_speed * cos(angle / 1000.0);
-        y += dt * bullet_speed * sin(angle / 1000.0);
-        time += dt;
+// Where something on a straight course is at clock, in Q16 milli-units, and
+// how far it goes each milli. This is what update() computes before it
+// rounds, so planning on it agrees with update() to the milli-unit.
+struct Course {
+    i64 x, y, vx, vy;
+};
+
+inline Course course(i32 x0, i32 y0, i32 t0, i32 speed, i32 angle, i32 clock) {
+    i64 vx = (i64)speed * fcos(angle), vy = (i64)speed * fsin(angle);
+    return {(i64)x0 * fix_one + vx * (clock - t0), (i64)y0 * fix_one + vy * (clock - t0), vx, vy};
+}
+
+inline Course course(const Rock &rock, i32 clock) {
+    return course(rock.x0, rock.y0, rock.t0, rock.speed, rock.angle, clock);
+}
+
+inline Course course(const Bullet &bullet, i32 clock) {
+    return course(bullet.x0, bullet.y0, bullet.t0, bullet_speed, bullet.angle, clock);
+}
+
+const i64 never = numeric_limits<i64>::max();
+
+// Millis until a Q16 coordinate x moving at v rounds to somewhere outside
+// [low, high), never if it doesn't move. advance() rounds halves up, so
+// that's from high - half on and below low - half.
+inline i64 time_to_leave(i64 x, i64 v, i32 low, i32 high) {
+    const i64 half = fix_one >> 1;
+    if (v > 0) return (max<i64>((i64)high * fix_one - half - x, 0) + v - 1) / v;
+    if (v < 0) return (max<i64>(x - ((i64)low * fix_one - half) + 1, 0) - v - 1) / -v;
+    return never;
+}
+
+// First clock in [from, until] at which two courses, (dx, dy) apart at from
+// and closing at (vx, vy), all Q16, are less than radius apart, -1 if never.
+// Done in integers throughout so every platform picks the same milli.
+inline i32 time_of_impact(i64 dx, i64 dy, i64 vx, i64 vy, i32 radius, i32 from, i32 until) {
+    i64 span = until - from;
+    i64 r = (i64)radius * fix_one;
+    // Too far apart on one axis to close in time. This also keeps the
+    // products below well inside 128 bits.
+    if (abs(dx) - abs(vx) * span >= r || abs(dy) - abs(vy) * span >= r) return -1;
+
+    // |d + v t|^2 - r^2 = a t^2 + 2 b t + c
+    i128 a = (i128)vx * vx + (i128)vy * vy;
+    i128 b = (i128)dx * vx + (i128)dy * vy;
+    i128 c = (i128)dx * dx + (i128)dy * dy - (i128)r * r;
+    if (c < 0) return from;
+    if (a == 0 || b >= 0) return -1;
+    i128 disc = b * b - a * c;
+    if (disc < 0) return -1;
+
+    auto gap = [&](i128 t) { return (a * t + 2 * b) * t + c; };
+    // First whole milli past the entry root. isqrt rounds down, which can
+    // only make that one milli late.
+    i128 t = (-b - isqrt(disc)) / a + 1;
+    if (t > 1 && gap(t - 1) < 0) t -= 1;
+    return t <= span && gap(t) < 0 ? from + (i32)t : -1;
+}
+
+// Rocks and bullets keep their course until something happens to them, so
+// the next thing that will is worked out once and queued: a bullet hitting a
+// rock, running out or leaving the map, a rock changing region or leaving
+// the map. Rescheduling a bullet bumps its epoch and the event it had queued
+// is skipped when it comes up.
+enum EventKind { EVENT_ROCK, EVENT_BULLET_HIT, EVENT_BULLET_OUT, EVENT_BULLET_EXPIRE };
+
+struct Event {
+    i32 time;
+    EventKind kind;
+    i32 id;
+    i32 epoch;
+    i32 rock;
+
+    inline bool operator>(const Event &other) const {
+        return tie(time, kind, id, epoch) > tie(other.time, other.kind, other.id, other.epoch);
     }
 };
 
+struct Plan {
+    i32 epoch = 0;
+    i32 time = 0;
+    i32 rock = -1;
+};
+
 struct Pellet {
     i32 id, x, y, value, type;
+    i32 region = -1;
+    i32 t0 = 0;
+};
 
-    inline string encode() const {
-        return S(id)+","+S(x)+","+S(y)+","+S(value)+","+S(type);
-    }
+struct Region {
+    SplitMix rng;
+    i32 target = 0;
+    i32 asleep = 0;
+    i32 respawn = 0;
+    bool awake = false;
+    // Pellets can land in a region before anyone has been near it, which
+    // only holds them until the region is generated for real.
+    bool generated = false;
+    unordered_set<i32> rocks;
+    // Rocks whose region event came up while asleep, queued again on waking.
+    vector<i32> parked;
+    unordered_set<i32> pellets;
 };
 
 struct Game {
@@ -70,10 +182,26 @@ struct Game {
     Table<Bullet> bullets;
     Table<Pellet> pellets;
     Table<Rock> rocks;
+    map<i32, Region> regions;
+
+    priority_queue<Event, vector<Event>, greater<Event>> events;
+    unordered_map<i32, Plan> plans;
+    // Bullets that were headed for each rock when they were planned.
+    unordered_map<i32, vector<i32>> hunters;
+    // Bullets whose flight passes near each region, by region key, so a new
+    // rock only looks at the ones that could reach it.
+    unordered_map<i32, unordered_set<i32>> flights;
+
+    // Pellets touched since the last broadcast, sent out together.
+    unordered_set<i32> changed_pellets;
+    unordered_set<i32> removed_pellets;
 
     bool finished = false;
     bool reset = false;
+    i32 clock = 0;
     i32 rock_count = (int)map_size/10;
+    i32 region_side = (map_size*1000 + region_size - 1) / region_size;
+    u64 seed = world_seed;
     i32 until_stop;
     i32 until_reset = 0;
     i32 until_reset_max;
@@ -90,12 +218,26 @@ struct Game {
     void did_hit_rock(Player &player);
     void did_hit_bullet(Player &player, Bullet &obj);
     void did_hit_pellet(Player &player, Pellet &obj);
-    void step(float dt);
-    Rock &spawn_rock();
+    void step(i32 dt);
+    void wake_regions(i32 dt);
+    void run_events(unordered_set<i32> &del_rocks, unordered_set<i32> &del_bullets, unordered_set<i32> &expired_bullets);
+    void plan_rock(Rock &rock, i32 from);
+    void plan_bullet(Bullet &bullet, i32 from);
+    void plan_all();
+    void intercept(Rock &rock);
+    void track_flight(const Bullet &bullet, bool flying);
+    void retarget(Rock &rock, i32 from);
+    void remove_rocks(const unordered_set<i32> &ids);
+    Region &generate_region(i32 key);
+    void evict_region(i32 key, Region &region);
+    Rock &spawn_rock(i32 key, Region &region);
     Player &spawn_player();
     Bullet &spawn_bullet(i32 pid, i32 x, i32 y, i32 angle);
     void spawn_pellets(Rock &rock);
     void spawn_pellets(Player &player);
+    void drop_pellet(i32 x, i32 y, i32 value, i32 type);
+    void remove_pellet(i32 id);
+    void expire_pellets();
 
     inline Game(i32 game_time, i32 reset_time) {
         until_stop = game_time;
@@ -114,8 +256,74 @@ struct Game {
         return bestId;
     }
 
-    inline string encode() const {
-        return S(map_size)+","+S(until_reset)+","+S(until_stop)+","+S(finished);
+    inline i32 region_of(i32 x, i32 y) const {
+        i32 rx = clip(x / region_size, 0, region_side - 1);
+        i32 ry = clip(y / region_size, 0, region_side - 1);
+        return ry * region_side + rx;
+    }
+
+    // Calls fn(rock) for every rock in the regions around (x, y), which is
+    // every rock that could be touching that point. Rocks are only moved
+    // when somebody looks at them.
+    template <class Fn>
+    inline void near_rocks(i32 x, i32 y, Fn fn) {
+        i32 key = region_of(x, y);
+        i32 rx = key % region_side, ry = key / region_side;
+        for (i32 j = max(ry - 1, 0); j <= min(ry + 1, region_side - 1); j++) {
+            for (i32 i = max(rx - 1, 0); i <= min(rx + 1, region_side - 1); i++) {
+                auto it = regions.find(j * region_side + i);
+                if (it == regions.end()) continue;
+                for (i32 rock_id : it->second.rocks) {
+                    Rock &rock = rocks.data[rock_id];
+                    rock.update(clock);
+                    if (fn(rock)) return;
+                }
+            }
+        }
+    }
+
+    // Calls fn(rock) for every rock in the regions within margin of the box
+    // spanned by two points.
+    template <class Fn>
+    inline void near_segment(i32 x1, i32 y1, i32 x2, i32 y2, i32 margin, Fn fn) {
+        i32 left = region_of(min(x1, x2) - margin, min(y1, y2) - margin);
+        i32 right = region_of(max(x1, x2) + margin, max(y1, y2) + margin);
+        for (i32 j = left / region_side; j <= right / region_side; j++) {
+            for (i32 i = left % region_side; i <= right % region_side; i++) {
+                auto it = regions.find(j * region_side + i);
+                if (it == regions.end()) continue;
+                for (i32 rock_id : it->second.rocks) fn(rocks.data[rock_id]);
+            }
+        }
+    }
+
+    // Calls fn(key) for every region within margin of the box a bullet
+    // covers over its whole flight, which is fixed once it's fired.
+    template <class Fn>
+    inline void flight_regions(const Bullet &bullet, i32 margin, Fn fn) {
+        Course end = course(bullet, bullet.t0 + bullet_decay + 1);
+        i32 x2 = end.x >> fix_shift, y2 = end.y >> fix_shift;
+        i32 left = region_of(min(bullet.x0, x2) - margin, min(bullet.y0, y2) - margin);
+        i32 right = region_of(max(bullet.x0, x2) + margin, max(bullet.y0, y2) + margin);
+        for (i32 j = left / region_side; j <= right / region_side; j++) {
+            for (i32 i = left % region_side; i <= right % region_side; i++) fn(j * region_side + i);
+        }
+    }
+
+    // Same for pellets.
+    template <class Fn>
+    inline void near_pellets(i32 x, i32 y, Fn fn) {
+        i32 key = region_of(x, y);
+        i32 rx = key % region_side, ry = key / region_side;
+        for (i32 j = max(ry - 1, 0); j <= min(ry + 1, region_side - 1); j++) {
+            for (i32 i = max(rx - 1, 0); i <= min(rx + 1, region_side - 1); i++) {
+                auto it = regions.find(j * region_side + i);
+                if (it == regions.end()) continue;
+                for (i32 pellet_id : it->second.pellets) {
+                    if (fn(pellets.data[pellet_id])) return;
+                }
+            }
+        }
     }
 };
 
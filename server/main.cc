@@ -3,16 +3,30 @@
 #include <string_view>
 
 #include "game.hh"
+#include "protocol.hh"
+#include "metrics.hh"
+#include "checkpoint.hh"
 
 using namespace std;
 
-bool handle_request(i32 sfd, string &req);
+bool handle_request(i32 sfd, string_view req);
 
 // ----------------------------------------------------------------------------
 // -- Global data
 // ----------------------------------------------------------------------------
 
+#define contains(x, y) (x.find(y) != x.end())
+
 i32 port = 6666;
+i32 metrics_port = 0;
+i32 server_fd = -1;
+i32 metrics_fd = -1;
+string control_path;
+string takeover_path;
+string checkpoint_path = "/tmp/galactica.ckpt";
+// Relays get the whole world on demand and skip the link back-off, so only
+// ones on this machine or holding the token may subscribe.
+string relay_token;
 
 Game game(game_time, reset_time);
 
@@ -25,10 +39,107 @@ unordered_set<i32> clients;
 map<i32, u64> last_ping;
 map<i32, i32> client_player;
 
+// Snapshot detail levels, from healthy to most constrained links. Each level
+// has a minimum interval between snapshots (millis) and a radius around the
+// client's own ship outside of which other ships are left out (0 = no limit).
+// Ships are left out silently, the client hides ones it stops hearing about.
+struct Detail {
+    u64 interval;
+    i32 radius;
+};
+
+const Detail details[] = {
+    {0, 0},
+    {50, 1200*1000},
+    {150, 900*1000},
+    {400, 600*1000},
+};
+
+const i32 max_detail = sizeof(details) / sizeof(details[0]) - 1;
+
+// Link estimates are refreshed this often (millis).
+const u64 LINK_PROBE = 250;
+// A link is congested once its backlog would take this long to drain at the
+// rate it has been draining (millis).
+const u64 LINK_BACKLOG = 250;
+// A link must look healthy for this long before it's given more detail.
+const u64 LINK_RECOVER = 2*1000;
+// Stamped pings for round trip estimates go out this often (millis).
+const u64 PING_PERIOD = 1000;
+
+// Per-client input limits for each class of command, as requests per second
+// and the burst allowed on top.
+enum Limit { LIMIT_COORD, LIMIT_FIRED, LIMIT_JOIN, LIMIT_OTHER, LIMIT_COUNT };
+
+struct Rate {
+    i32 rate;
+    i32 burst;
+};
+
+const Rate rates[LIMIT_COUNT] = {
+    {60, 30},
+    {10, 5},
+    {1, 3},
+    {20, 20},
+};
+
+inline Limit limit_of(u32 command) {
+    string_view name = command_names[command];
+    if (name == "usr-coord") return LIMIT_COORD;
+    if (name == "usr-fired") return LIMIT_FIRED;
+    if (name == "join" || name == "usr-resync" || name == "conn") return LIMIT_JOIN;
+    return LIMIT_OTHER;
+}
+
+struct Link {
+    TokenBucket buckets[LIMIT_COUNT];
+    bool sim = false;
+    bool relay = false;
+    i32 level = 0;
+    // Smoothed round trip of our pings (micros), 0 until one comes back.
+    u64 rtt = 0;
+    u64 queued = 0;
+    // outbox_total at the last probe, and the smoothed rate the link has
+    // been draining at since (bytes per second).
+    u64 total = 0;
+    u64 drain = 0;
+    u64 last_probe = 0;
+    u64 last_change = 0;
+    u64 last_snapshot = 0;
+    u64 last_ping = 0;
+    // When each request handled since the last tick reached the kernel
+    // (micros), so its wait includes sitting unread in the receive queue.
+    vector<u64> arrivals;
+};
+
+map<i32, Link> links;
+map<i32, Latency> link_latency;
+
+// Entities a joining client hasn't been sent yet, farthest first so the
+// nearest ones can be popped off the back.
+enum SyncKind { SYNC_ROCK, SYNC_BULLET, SYNC_PELLET };
+
+struct Sync {
+    SyncKind kind;
+    i32 id;
+};
+
+// Upper bound on initial sync bytes written to one client per tick.
+const u64 SYNC_CHUNK = 8*1024;
+
+map<i32, vector<Sync>> pending_sync;
+
+// Game clock at the last world sum sent to simulating clients.
+const i32 WORLD_SUM_PERIOD = 1000;
+i32 last_world_sum = 0;
+
 void resetGame() {
     game = Game(game_time, reset_time);
+    game.seed = world_seed++;
     game.init();
     client_player.clear();
+    pending_sync.clear();
+    last_world_sum = 0;
 }
 
 
@@ -36,82 +147,270 @@ void resetGame() {
 // -- Outbox
 // ----------------------------------------------------------------------------
 
-string encode_pellets(vector<Pellet> &objs) {
-    string msg;
-    for (Pellet &obj : objs) {
-        if (!msg.empty()) msg += ";";
-        msg += "stat-pellet,"+obj.encode();
-    }
-    return msg;
+// Scratch buffers for encoding. Each use clears them first, so they keep
+// their capacity and a steady tick doesn't allocate for its messages.
+string frame, sim_frame;
+
+// Outgoing frames are counted where they're sent, once per frame however
+// many clients it goes to.
+void xsend_one(i32 fd, const string &message) {
+    if (fd < 0) return;
+    count_out(message);
+    xsend(fd, message);
 }
 
-void xcast(string message) {
+void xcast(const string &message) {
     //printf("[info] xcast %s\n", message.c_str());
+    count_out(message, clients.size());
     for (i32 fd : clients) xsend(fd, message);
 }
 
-void cast_bullet(Bullet &bullet) {
-    xcast("stat-bullet,"+bullet.encode());
+// Clients that simulate rocks and bullets themselves get sim_message instead,
+// or nothing at all if it's empty.
+void xcast(const string &message, const string &sim_message) {
+    u64 sims = 0;
+    for (i32 fd : clients) {
+        bool sim = links[fd].sim;
+        sims += sim;
+        const string &x = sim ? sim_message : message;
+        if (!x.empty()) xsend(fd, x);
+    }
+    count_out(message, clients.size() - sims);
+    count_out(sim_message, sims);
 }
 
-void cast_game_updates(Game &game) {
-    xcast("stat-game,"+game.encode());
+template <class Msg, class... T>
+void cast(const T&... values) {
+    frame.clear();
+    encode<Msg>(frame, values...);
+    xcast(frame);
 }
 
-void cast_del_bullet(i32 id) {
-    xcast("del-bullet,"+S(id));
+void cast_bullet(Bullet &bullet) {
+    frame.clear();
+    sim_frame.clear();
+    encode<StatBullet>(frame, bullet);
+    encode<NewBullet>(sim_frame, bullet);
+    xcast(frame, sim_frame);
 }
 
-void cast_del_pellet(i32 id) {
-    xcast("del-pellet,"+S(id));
+// Bullets that simply ran out of time, simulating clients drop those on
+// their own.
+void cast_expired_bullet(i32 id) {
+    frame.clear();
+    sim_frame.clear();
+    encode<DelBullet>(frame, id);
+    xcast(frame, sim_frame);
+}
+
+void cast_del_bullet(i32 id) {
+    cast<DelBullet>(id);
 }
 
 void cast_del_ship(i32 id) {
-    xcast("del-ship,"+S(id));
+    cast<DelShip>(id);
 }
 
 void cast_del_rock(i32 id) {
-    xcast("del-rock,"+S(id));
+    cast<DelRock>(id);
+}
+
+// Everything that happened to pellets since the last call goes out as one
+// frame: removals first, then new and merged pellets.
+void cast_pellet_changes(Game &game) {
+    frame.clear();
+    for (i32 id : game.removed_pellets) append<DelPellet>(frame, id);
+    for (i32 id : game.changed_pellets) append<StatPellet>(frame, game.pellets.data[id]);
+    game.removed_pellets.clear();
+    game.changed_pellets.clear();
+    if (!frame.empty()) xcast(frame);
 }
 
-void send_pellets(i32 fd, vector<Pellet> objs) {
-    xsend(fd, encode_pellets(objs));
+void cast_rocks(const vector<i32> &ids, Game &game) {
+    frame.clear();
+    sim_frame.clear();
+    for (i32 id : ids) {
+        append<StatRock>(frame, game.rocks.data[id]);
+        append<NewRock>(sim_frame, game.rocks.data[id]);
+    }
+    if (!frame.empty()) xcast(frame, sim_frame);
 }
 
-void cast_pellets(vector<Pellet> objs) {
-    xcast(encode_pellets(objs));
+// Lets simulating clients check they agree with us on which rocks and
+// bullets exist: counts and order-independent sums of hashed ids.
+void cast_world_sum(Game &game) {
+    u32 rock_sum = 0, bullet_sum = 0;
+    for (auto const& [id, obj] : game.rocks.data) rock_sum += (u32) id * 2654435761u;
+    for (auto const& [id, obj] : game.bullets.data) bullet_sum += (u32) id * 2654435761u;
+    frame.clear();
+    encode<SumWorld>(frame, game.clock, game.rocks.data.size(), rock_sum, game.bullets.data.size(), bullet_sum);
+
+    // Clients still receiving their initial sync can't agree yet.
+    u64 sent = 0;
+    for (i32 fd : clients) {
+        if (!links[fd].sim || contains(pending_sync, fd)) continue;
+        xsend(fd, frame);
+        sent += 1;
+    }
+    count_out(frame, sent);
 }
 
 void send_bullet(i32 fd, Bullet &bullet) {
-    xsend(fd, "stat-bullet,"+bullet.encode());
+    frame.clear();
+    encode<StatBullet>(frame, bullet);
+    xsend_one(fd, frame);
 }
 
 void send_rock(i32 fd, Rock &rock) {
-    xsend(fd, "stat-rock,"+rock.encode());
+    frame.clear();
+    encode<StatRock>(frame, rock);
+    xsend_one(fd, frame);
 }
 
-void send_all_particles(i32 fd, Game &game) {
-    string res = "pong";
+void queue_all_particles(i32 fd, Game &game, i32 x, i32 y) {
+    vector<pair<i64, Sync>> order;
     for (auto const& [id, obj] : game.rocks.data)
-        res += ";stat-rock,"+obj.encode();
+        order.push_back({idistsq(x, y, obj.x, obj.y), {SYNC_ROCK, id}});
     for (auto const& [id, obj] : game.bullets.data)
-        res += ";stat-bullet,"+obj.encode();
+        order.push_back({idistsq(x, y, obj.x, obj.y), {SYNC_BULLET, id}});
     for (auto const& [id, obj] : game.pellets.data)
-        res += ";stat-pellet,"+obj.encode();
-    xsend(fd, res);
+        order.push_back({idistsq(x, y, obj.x, obj.y), {SYNC_PELLET, id}});
+
+    sort(order.begin(), order.end(), [](auto &a, auto &b) { return a.first > b.first; });
+
+    vector<Sync> &queue = pending_sync[fd];
+    queue.clear();
+    queue.reserve(order.size());
+    for (auto &[d, sync] : order) queue.push_back(sync);
 }
 
-void send_world_updates(i32 fd, Game &game) {
-    //xsend(fd, "stat-ship,"+player.encode());
-    string res;
+// Stream the next chunk of a client's initial sync. Entities removed since
+// the join are skipped, and ones spawned since were already broadcast.
+void send_sync_chunk(i32 fd, Game &game, vector<Sync> &queue) {
+    bool sim = links[fd].sim;
+    string &res = frame;
+    res.clear();
+    while (!queue.empty() && res.size() < SYNC_CHUNK) {
+        Sync sync = queue.back();
+        queue.pop_back();
+        if (sync.kind == SYNC_ROCK) {
+            auto it = game.rocks.data.find(sync.id);
+            if (it == game.rocks.data.end()) continue;
+            if (sim) {
+                append<NewRock>(res, it->second);
+            } else {
+                // Rocks in sleeping regions haven't been moved in a while.
+                it->second.update(game.clock);
+                append<StatRock>(res, it->second);
+            }
+        } else if (sync.kind == SYNC_BULLET) {
+            auto it = game.bullets.data.find(sync.id);
+            if (it == game.bullets.data.end()) continue;
+            if (sim) {
+                append<NewBullet>(res, it->second);
+            } else {
+                append<StatBullet>(res, it->second);
+            }
+        } else {
+            auto it = game.pellets.data.find(sync.id);
+            if (it == game.pellets.data.end()) continue;
+            append<StatPellet>(res, it->second);
+        }
+    }
+    if (links[fd].relay) {
+        sim_frame.clear();
+        encode<SyncWorld>(sim_frame, queue.size());
+        if (!res.empty()) sim_frame += ';' + res;
+        xsend_one(fd, sim_frame);
+    } else if (!res.empty()) {
+        xsend_one(fd, res);
+    }
+}
+
+void send_pending_sync(Game &game) {
+    for (auto it = pending_sync.begin(); it != pending_sync.end();) {
+        i32 fd = it->first;
+        // Let a slow client drain what it already has before adding more.
+        if (!contains(outbox, fd)) send_sync_chunk(fd, game, it->second);
+        if (it->second.empty()) {
+            it = pending_sync.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void send_world_updates(i32 fd, Game &game, const Detail &detail) {
+    Player *self = nullptr;
+    if (contains(client_player, fd)) self = &game.players.data[client_player[fd]];
+
+    string &res = frame;
+    res.clear();
+    encode<StatGame>(res, game);
     for (auto const& [id, obj] : game.players.data) {
-        //if (obj.game_over) continue;
-        //if (dist(player.x, player.y, obj.x, obj.y) > 500*1000) continue;
-        //if (player.id == id) continue;
-        if (!res.empty()) res += ";";
-        res += "stat-ship,"+obj.encode();
+        // Without a ship of its own, like a spectator, there's nothing to
+        // measure the radius from, so the client gets every ship.
+        if (self && detail.radius > 0 && obj.id != self->id) {
+            if (!within(self->x, self->y, obj.x, obj.y, detail.radius)) continue;
+        }
+        append<StatShip>(res, obj);
+    }
+    xsend_one(fd, res);
+}
+
+// Back off as soon as the link looks congested, but only move back towards
+// full detail once it has stayed healthy for a while. The round trip comes
+// from our stamped pings, the throughput from how fast the queue drains.
+void probe_link(i32 fd, Link &link, u64 time) {
+    u64 queued = xqueued(fd);
+    u64 total = contains(outbox_total, fd) ? outbox_total[fd] : 0;
+    metrics.queued_bytes.observe(queued);
+    u64 drained = link.queued + (total - link.total);
+    drained = drained > queued ? drained - queued : 0;
+    u64 elapsed = max<u64>(time - link.last_probe, 1);
+    u64 rate = drained * 1000 / elapsed;
+    link.drain = link.drain == 0 ? rate : link.drain - link.drain / 4 + rate / 4;
+    link.queued = queued;
+    link.total = total;
+    link.last_probe = time;
+    auto latency = link_latency.find(fd);
+    link.rtt = latency == link_latency.end() ? 0 : latency->second.srtt.load(memory_order_relaxed);
+
+    u64 backlog = queued * 1000 / max<u64>(link.drain, 1);
+    bool congested = queued > 64*1024 || (queued > 16*1024 && backlog > LINK_BACKLOG) || link.rtt > 300*1000;
+    bool healthy = queued < 4*1024 && link.rtt < 120*1000;
+
+    if (congested && link.level < max_detail) {
+        link.level += 1;
+        link.last_change = time;
+        printf("[info] client %d backs off to level %d (rtt %lu us, drain %lu B/s, queued %lu)\n", fd, link.level, link.rtt, link.drain, queued);
+    } else if (healthy && link.level > 0 && time - link.last_change > LINK_RECOVER) {
+        link.level -= 1;
+        link.last_change = time;
+        printf("[info] client %d recovers to level %d\n", fd, link.level);
+    }
+}
+
+void send_snapshots(Game &game) {
+    u64 time = millis();
+    for (i32 fd : clients) {
+        Link &link = links[fd];
+        if (time - link.last_probe >= LINK_PROBE) probe_link(fd, link, time);
+        // Pings only go out on an empty outbox, so they're written as soon
+        // as they're stamped and the round trip leaves out our own queuing.
+        if (time - link.last_ping >= PING_PERIOD && !contains(outbox, fd)) {
+            link.last_ping = time;
+            frame.clear();
+            encode<Ping>(frame, Stamped{micros()});
+            xsend_one(fd, frame);
+        }
+
+        // Relays fan out to many viewers, they always get everything.
+        const Detail &detail = details[link.relay ? 0 : link.level];
+        if (time - link.last_snapshot < detail.interval) continue;
+        link.last_snapshot = time;
+        send_world_updates(fd, game, detail);
     }
-    xsend(fd, res);
 }
 
 
@@ -134,15 +433,12 @@ void Player::update_shield(i32 dt) {
 }
 
 void Game::init() {
-    printf("[info] new game\n");
-    for (i32 i = 0; i < rock_count; i++) {
-        spawn_rock();
-    }
+    printf("[info] new game (seed %lu)\n", seed);
 }
 
 void Game::terminate_player(Player &player) {
-    xcast("del-ship,"+S(player.id));
-    xcast("log-dead,"+player.nick);
+    cast<DelShip>(player.id);
+    cast<LogDead>(player.nick);
 
     printf("terminate player %d\n", player.id);
     player.game_over = true;
@@ -150,7 +446,11 @@ void Game::terminate_player(Player &player) {
 }
 
 void Game::did_hit_rock(Player &player) {
-    if (player.fd > 0) xsend(player.fd, "got-hit");
+    if (player.fd > 0) {
+        frame.clear();
+        encode<GotHit>(frame);
+        xsend_one(player.fd, frame);
+    }
     player.energy -= 1;
     if (player.energy <= 0) {
         terminate_player(player);
@@ -160,7 +460,11 @@ void Game::did_hit_rock(Player &player) {
 }
 
 void Game::did_hit_bullet(Player &player, Bullet &obj) {
-    if (player.fd > 0) xsend(player.fd, "got-hit");
+    if (player.fd > 0) {
+        frame.clear();
+        encode<GotHit>(frame);
+        xsend_one(player.fd, frame);
+    }
     player.energy -= 1;
     if (player.energy <= 0) {
         terminate_player(player);
@@ -177,7 +481,7 @@ void Game::did_hit_pellet(Player &player, Pellet &obj) {
 }
 
 
-void Game::step(float dt) {
+void Game::step(i32 dt) {
     if (reset) {
         return;
     } else if (finished) {
@@ -190,15 +494,16 @@ void Game::step(float dt) {
         until_stop -= dt;
         if (until_stop < 0) {
             i32 winner_id = winner();
-            xcast("game-over,"+S(winner_id));
-            if (winner_id != -1) xcast("log-win,"+players.data[winner_id].nick);
+            cast<GameOver>(winner_id);
+            if (winner_id != -1) cast<LogWin>(players.data[winner_id].nick);
             finished = true;
             until_reset = until_reset_max;
             return;
         }
     }
 
-    unordered_set<i32> del_rocks, del_bullets, del_pellets;
+    clock += dt;
+    unordered_set<i32> del_rocks, del_bullets, del_pellets, expired_bullets;
 
     for (auto& [id, player] : players.data) {
         if (player.game_over) {
@@ -206,81 +511,338 @@ void Game::step(float dt) {
         }
         player.update(dt);
 
-        for (auto& [obj_id, obj] : pellets.data) {
-            if (dist(player.x, player.y, obj.x, obj.y) < 8*1000) {
+        near_pellets(player.x, player.y, [&](Pellet &obj) {
+            if (!contains(del_pellets, obj.id) && within<8*1000>(player.x, player.y, obj.x, obj.y)) {
                 did_hit_pellet(player, obj);
-                del_pellets.insert(obj_id);
+                del_pellets.insert(obj.id);
             }
-        }
+            return false;
+        });
 
         if (player.shield) continue;
 
-        for (auto const& [rock_id, rock] : rocks.data) {
-            if (dist(player.x, player.y, rock.x, rock.y) < rock.size * 1000 / 2) {
+        near_rocks(player.x, player.y, [&](Rock &rock) {
+            if (within(player.x, player.y, rock.x, rock.y, rock.size * 1000 / 2)) {
                 did_hit_rock(player);
-                break;
+                return true;
             }
-        }
+            return false;
+        });
     }
 
-    for (auto& [rock_id, rock] : rocks.data) {
-        rock.update(dt);
-
-        bool oob = rock.x < 0 || rock.y < 0 || rock.x > map_size*1000 || rock.y > map_size*1000;
-        if (oob) {
-            del_rocks.insert(rock_id);
-        }
-    }
+    wake_regions(dt);
+    run_events(del_rocks, del_bullets, expired_bullets);
 
+    // Ships don't fly straight, so they're still checked every tick.
     for (auto& [bullet_id, bullet] : bullets.data) {
-        bullet.update(dt);
-        bool oob = bullet.x < 0 || bullet.y < 0 || bullet.x > map_size*1000 || bullet.y > map_size*1000;
-        bool timeout = bullet.time > bullet_decay;
-        if (oob || timeout) {
-            del_bullets.insert(bullet_id);
-        }
+        if (contains(del_bullets, bullet_id) || contains(expired_bullets, bullet_id)) continue;
+        bullet.update(clock);
 
         // check if bullet collides with any player
         for (auto &[player_id, player] : players.data) {
             if (player.game_over || player.shield || player_id == bullet.pid) continue;
 
-            if (dist(player.x, player.y, bullet.x, bullet.y) < 6*1000) {
+            if (within<6*1000>(player.x, player.y, bullet.x, bullet.y)) {
                 did_hit_bullet(player, bullet);
                 del_bullets.insert(bullet_id);
             }
         }
-
-        // check if bullet collides with any rock
-        for (auto &[rock_id, rock] : rocks.data) {
-            if (dist(rock.x, rock.y, bullet.x, bullet.y) < rock.size * 1000 / 2) {
-                del_bullets.insert(bullet_id);
-                rock.health -= 1;
-                if (rock.health <= 0) {
-                    del_rocks.insert(rock_id);
-                    spawn_pellets(rock);
-                }
-            }
-        }
     }
 
 
     for (i32 id : del_rocks) cast_del_rock(id);
-    for (i32 id : del_pellets) cast_del_pellet(id);
     for (i32 id : del_bullets) cast_del_bullet(id);
+    for (i32 id : expired_bullets) {
+        if (!contains(del_bullets, id)) cast_expired_bullet(id);
+    }
+    for (i32 id : del_bullets) plans.erase(id);
+    for (i32 id : expired_bullets) plans.erase(id);
+    for (i32 id : del_bullets) track_flight(bullets.data[id], false);
+    for (i32 id : expired_bullets) track_flight(bullets.data[id], false);
     bullets.remove(del_bullets);
-    pellets.remove(del_pellets);
-    rocks.remove(del_rocks);
+    bullets.remove(expired_bullets);
+    for (i32 id : del_pellets) remove_pellet(id);
+    expire_pellets();
+    remove_rocks(del_rocks);
 }
 
-Rock &Game::spawn_rock() {
-    int x = coord_dist(gen);
-    int y = coord_dist(gen);
-    int angle = angle_dist(gen);
-    int size = random_normal(60, 10);
-    int speed = random_normal(5, 2);
-    Rock rock{-1, x, y, angle, speed, size, 3};
+// Regions within region_wake of a live player are awake: they get generated
+// on first sight, simulated and topped back up as their rocks are destroyed.
+// Everything else is frozen and eventually evicted.
+void Game::wake_regions(i32 dt) {
+    for (auto &[key, region] : regions) region.awake = false;
+
+    for (auto const& [id, player] : players.data) {
+        if (player.game_over) continue;
+        i32 key = region_of(player.x, player.y);
+        i32 rx = key % region_side, ry = key / region_side;
+        for (i32 j = max(ry - region_wake, 0); j <= min(ry + region_wake, region_side - 1); j++) {
+            for (i32 i = max(rx - region_wake, 0); i <= min(rx + region_wake, region_side - 1); i++) {
+                i32 near = j * region_side + i;
+                auto it = regions.find(near);
+                bool seen = it != regions.end() && it->second.generated;
+                Region &region = seen ? it->second : generate_region(near);
+                region.awake = true;
+            }
+        }
+    }
+
+    vector<i32> evict;
+    for (auto &[key, region] : regions) {
+        if (!region.awake) {
+            region.asleep += dt;
+            if (region.asleep > region_evict) evict.push_back(key);
+            continue;
+        }
+
+        region.asleep = 0;
+        // Whatever came up while it slept is looked at now.
+        for (i32 rock_id : region.parked) events.push({clock, EVENT_ROCK, rock_id, 0, -1});
+        region.parked.clear();
+        if ((i32)region.rocks.size() >= region.target) {
+            region.respawn = region_respawn;
+            continue;
+        }
+        region.respawn -= dt;
+        if (region.respawn <= 0) {
+            region.respawn = region_respawn;
+            cast_rocks({spawn_rock(key, region).id}, *this);
+        }
+    }
+
+    for (i32 key : evict) evict_region(key, regions[key]);
+}
+
+// Bullets can only reach rocks this close to their path: the largest rock
+// radius plus how far a rock drifts in a bullet's lifetime, and then some.
+const i32 BULLET_REACH = 100*1000;
+
+void Game::run_events(unordered_set<i32> &del_rocks, unordered_set<i32> &del_bullets, unordered_set<i32> &expired_bullets) {
+    while (!events.empty() && events.top().time <= clock) {
+        Event event = events.top();
+        events.pop();
+
+        if (event.kind == EVENT_ROCK) {
+            auto it = rocks.data.find(event.id);
+            if (it == rocks.data.end() || it->second.disable) continue;
+            Rock &rock = it->second;
+            // Sleeping regions hold on to their rocks until they wake up,
+            // when they are wherever their spawn record puts them.
+            Region &home = regions[rock.region];
+            if (!home.awake) {
+                home.parked.push_back(rock.id);
+                continue;
+            }
+            rock.update(event.time);
+
+            // Rocks drifting into a region nobody has seen yet leave the
+            // world, the region will get its own when it's generated.
+            bool oob = rock.x < 0 || rock.y < 0 || rock.x > map_size*1000 || rock.y > map_size*1000;
+            i32 to = region_of(rock.x, rock.y);
+            auto region = regions.find(to);
+            if (oob || region == regions.end() || !region->second.generated) {
+                del_rocks.insert(rock.id);
+                retarget(rock, event.time);
+                continue;
+            }
+            if (to != rock.region) {
+                regions[rock.region].rocks.erase(rock.id);
+                region->second.rocks.insert(rock.id);
+                rock.region = to;
+            }
+            plan_rock(rock, event.time);
+            continue;
+        }
+
+        auto it = bullets.data.find(event.id);
+        if (it == bullets.data.end() || plans[event.id].epoch != event.epoch) continue;
+        Bullet &bullet = it->second;
+        // Nothing more is planned for a bullet once its event comes up.
+        plans[event.id].epoch += 1;
+
+        if (event.kind == EVENT_BULLET_OUT) {
+            del_bullets.insert(bullet.id);
+        } else if (event.kind == EVENT_BULLET_EXPIRE) {
+            expired_bullets.insert(bullet.id);
+        } else {
+            auto target = rocks.data.find(event.rock);
+            if (target == rocks.data.end() || target->second.disable) {
+                plan_bullet(bullet, event.time);
+                continue;
+            }
+            Rock &rock = target->second;
+            del_bullets.insert(bullet.id);
+            rock.health -= 1;
+            if (rock.health <= 0) {
+                rock.update(event.time);
+                del_rocks.insert(rock.id);
+                spawn_pellets(rock);
+                retarget(rock, event.time);
+            }
+        }
+    }
+}
+
+// Queues the next time the rock leaves its region, which includes leaving
+// the map.
+void Game::plan_rock(Rock &rock, i32 from) {
+    Course c = course(rock, from);
+    i32 left = (rock.region % region_side) * region_size;
+    i32 top = (rock.region / region_side) * region_size;
+    i64 t = min(time_to_leave(c.x, c.vx, left, min(left + region_size, map_size*1000 + 1)),
+                time_to_leave(c.y, c.vy, top, min(top + region_size, map_size*1000 + 1)));
+    if (t > 1 << 30) return;
+    events.push({from + max((i32)t, 1), EVENT_ROCK, rock.id, 0, -1});
+}
+
+// Queues whatever comes first for the bullet: the first rock along its path,
+// leaving the map or running out.
+void Game::plan_bullet(Bullet &bullet, i32 from) {
+    Plan &plan = plans[bullet.id];
+    plan.epoch += 1;
+    plan.rock = -1;
+
+    Course c = course(bullet, from);
+    i32 expire = bullet.t0 + bullet_decay + 1;
+    i64 out = min(time_to_leave(c.x, c.vx, 0, map_size*1000 + 1), time_to_leave(c.y, c.vy, 0, map_size*1000 + 1));
+    EventKind kind = out < expire - from ? EVENT_BULLET_OUT : EVENT_BULLET_EXPIRE;
+    plan.time = kind == EVENT_BULLET_OUT ? from + (i32)out : expire;
+
+    i64 span = plan.time - from;
+    i32 x1 = c.x >> fix_shift, y1 = c.y >> fix_shift;
+    i32 x2 = (c.x + c.vx * span) >> fix_shift, y2 = (c.y + c.vy * span) >> fix_shift;
+    near_segment(x1, y1, x2, y2, BULLET_REACH, [&](Rock &rock) {
+        if (rock.health <= 0 || rock.disable) return;
+        // A rock spawned after from wasn't there to be hit before its t0.
+        i32 start = max(from, rock.t0);
+        if (start > plan.time) return;
+        Course b = course(bullet, start), r = course(rock, start);
+        i32 t = time_of_impact(b.x - r.x, b.y - r.y, b.vx - r.vx, b.vy - r.vy, rock.size * 1000 / 2, start, plan.time);
+        if (t < 0) return;
+        // Ties go to the lowest id so the outcome doesn't depend on set order.
+        if (plan.rock < 0 || t < plan.time || (t == plan.time && rock.id < plan.rock)) {
+            plan.time = t;
+            plan.rock = rock.id;
+        }
+    });
+
+    if (plan.rock >= 0) {
+        kind = EVENT_BULLET_HIT;
+        hunters[plan.rock].push_back(bullet.id);
+    }
+    events.push({plan.time, kind, bullet.id, plan.epoch, plan.rock});
+}
+
+// Checkpoints don't carry the queue, it's rebuilt from the entities.
+void Game::plan_all() {
+    for (auto &[id, rock] : rocks.data) plan_rock(rock, clock);
+    for (auto &[id, bullet] : bullets.data) {
+        track_flight(bullet, true);
+        plan_bullet(bullet, max(clock, bullet.t0));
+    }
+}
+
+void Game::track_flight(const Bullet &bullet, bool flying) {
+    flight_regions(bullet, BULLET_REACH, [&](i32 key) {
+        if (flying) {
+            flights[key].insert(bullet.id);
+            return;
+        }
+        auto it = flights.find(key);
+        if (it == flights.end()) return;
+        it->second.erase(bullet.id);
+        if (it->second.empty()) flights.erase(it);
+    });
+}
+
+// A new rock may get in the way of bullets already flying. Anything that can
+// hit it passes within BULLET_REACH of where it is now, so of its region.
+void Game::intercept(Rock &rock) {
+    auto flying = flights.find(rock.region);
+    if (flying == flights.end()) return;
+    Course r = course(rock, clock);
+    for (i32 id : flying->second) {
+        Bullet &bullet = bullets.data[id];
+        Plan &plan = plans[id];
+        if (plan.time <= clock) continue;
+        Course c = course(bullet, clock);
+        i32 t = time_of_impact(c.x - r.x, c.y - r.y, c.vx - r.vx, c.vy - r.vy, rock.size * 1000 / 2, clock, plan.time - 1);
+        if (t >= 0) plan_bullet(bullet, clock);
+    }
+}
+
+// The rock is going away, bullets that were headed for it look again.
+void Game::retarget(Rock &rock, i32 from) {
+    rock.disable = true;
+    auto it = hunters.find(rock.id);
+    if (it == hunters.end()) return;
+    vector<i32> ids = move(it->second);
+    hunters.erase(it);
+    for (i32 id : ids) {
+        auto bullet = bullets.data.find(id);
+        if (bullet == bullets.data.end() || plans[id].rock != rock.id) continue;
+        plan_bullet(bullet->second, max(from, bullet->second.t0));
+    }
+}
+
+void Game::remove_rocks(const unordered_set<i32> &ids) {
+    for (i32 id : ids) {
+        auto it = rocks.data.find(id);
+        if (it == rocks.data.end()) continue;
+        auto region = regions.find(it->second.region);
+        if (region != regions.end()) region->second.rocks.erase(id);
+        hunters.erase(id);
+    }
+    rocks.remove(ids);
+}
+
+// A region's initial rocks depend only on the world seed and its position,
+// so an evicted region comes back the same way it was first seen.
+Region &Game::generate_region(i32 key) {
+    Region &region = regions[key];
+    region.generated = true;
+    region.rng = SplitMix{seed ^ ((u64)key * 0xD1B54A32D192ED03ull)};
+
+    i64 area = (i64)map_size * map_size;
+    region.target = max((i64)1, ((i64)rock_count * (region_size/1000) * (region_size/1000) + area/2) / area);
+    region.respawn = region_respawn;
+
+    vector<i32> spawned;
+    for (i32 i = 0; i < region.target; i++) spawned.push_back(spawn_rock(key, region).id);
+    cast_rocks(spawned, *this);
+    return region;
+}
+
+void Game::evict_region(i32 key, Region &region) {
+    for (i32 rock_id : region.rocks) rocks.data[rock_id].disable = true;
+    for (i32 rock_id : region.rocks) retarget(rocks.data[rock_id], clock);
+    for (i32 rock_id : region.rocks) {
+        hunters.erase(rock_id);
+        cast_del_rock(rock_id);
+        rocks.remove(rock_id);
+    }
+    for (i32 pellet_id : region.pellets) {
+        changed_pellets.erase(pellet_id);
+        removed_pellets.insert(pellet_id);
+        pellets.remove(pellet_id);
+    }
+    regions.erase(key);
+}
+
+Rock &Game::spawn_rock(i32 key, Region &region) {
+    i32 left = (key % region_side) * region_size;
+    i32 top = (key / region_side) * region_size;
+    i32 x = region.rng.uniform(left, min(left + region_size, map_size*1000) - 1);
+    i32 y = region.rng.uniform(top, min(top + region_size, map_size*1000) - 1);
+    i32 angle = region.rng.uniform(0, TAU*1000);
+    i32 size = region.rng.normal(60, 10);
+    i32 speed = region.rng.normal(5, 2);
+    Rock rock{-1, x, y, angle, speed, size, 3, key, false, x, y, clock};
     i32 id = rocks.append(rock);
     rocks.data[id].id = id;
+    region.rocks.insert(id);
+    plan_rock(rocks.data[id], clock);
+    intercept(rocks.data[id]);
     return rocks.data[id];
 }
 
@@ -296,54 +858,100 @@ Player &Game::spawn_player() {
 }
 
 Bullet &Game::spawn_bullet(i32 pid, i32 x, i32 y, i32 angle) {
-    Bullet bullet{-1, pid, x, y, angle, 0};
+    Bullet bullet{-1, pid, x, y, angle, 0, x, y, clock};
     i32 id = bullets.append(bullet);
     bullets.data[id].id = id;
+    track_flight(bullets.data[id], true);
+    plan_bullet(bullets.data[id], clock);
     return bullets.data[id];
 }
 
 void Game::spawn_pellets(Rock &rock) {
     i32 spiceCount = 6;
 
-    vector<Pellet> newPellets;
     for (i32 i = 0; i < spiceCount; i++) {
         i32 x = random_normal(rock.x, 10*1000);
         i32 y = random_normal(rock.y, 10*1000);
-        i32 id = pellets.append(Pellet{-1, x, y, 1, 0});
-        Pellet &pellet = pellets.data[id];
-        pellet.id = id;
-        newPellets.push_back(pellet);
+        drop_pellet(x, y, 1, 0);
     }
-
-    cast_pellets(newPellets);
 }
 
 void Game::spawn_pellets(Player &player) {
     i32 energyCount = 2;
     i32 spiceCount = 3;
 
-    vector<Pellet> newPellets;
     if (player.spice >= spiceCount) {
         for (i32 i = 0; i < spiceCount; i++) {
             i32 x = random_normal(player.x, 10*1000);
             i32 y = random_normal(player.y, 10*1000);
-            Pellet pellet{-1, x, y, player.spice / spiceCount, 0};
-            i32 id = pellets.append(pellet);
-            pellets.data[id].id = id;
-            newPellets.push_back(pellets.data[id]);
+            drop_pellet(x, y, player.spice / spiceCount, 0);
         }
     }
 
     for (i32 i = 0; i < energyCount; i++) {
         i32 x = random_normal(player.x, 10*1000);
         i32 y = random_normal(player.y, 10*1000);
-        Pellet pellet{-1, x, y, 1, 1};
-        i32 id = pellets.append(pellet);
-        pellets.data[id].id = id;
-        newPellets.push_back(pellets.data[id]);
+        drop_pellet(x, y, 1, 1);
+    }
+}
+
+// A pellet folds into the closest one of its type in the region if that is
+// within pellet_merge, or whatever the distance once the region is full. A
+// full region with nothing to fold into gives up its oldest pellet. Dropping
+// into a region nobody has been near yet doesn't generate its rocks.
+void Game::drop_pellet(i32 x, i32 y, i32 value, i32 type) {
+    x = clip(x, 0, map_size*1000);
+    y = clip(y, 0, map_size*1000);
+    i32 key = region_of(x, y);
+    Region &region = regions[key];
+    bool full = region.pellets.size() >= pellet_cap;
+
+    Pellet *closest = nullptr;
+    i64 best = full ? numeric_limits<i64>::max() : (i64)pellet_merge * pellet_merge;
+    for (i32 id : region.pellets) {
+        Pellet &pellet = pellets.data[id];
+        if (pellet.type != type) continue;
+        i64 d = idistsq(x, y, pellet.x, pellet.y);
+        if (d < best) {
+            best = d;
+            closest = &pellet;
+        }
     }
+    // The merged pellet is as fresh as what was just dropped into it. It's
+    // replaced under a new id so the table stays in expiry order.
+    if (closest != nullptr) {
+        x = closest->x;
+        y = closest->y;
+        value += closest->value;
+        remove_pellet(closest->id);
+    } else if (full) {
+        remove_pellet(*min_element(region.pellets.begin(), region.pellets.end()));
+    }
+
+    i32 id = pellets.append(Pellet{-1, x, y, value, type, key, clock});
+    pellets.data[id].id = id;
+    region.pellets.insert(id);
+    changed_pellets.insert(id);
+}
+
+void Game::remove_pellet(i32 id) {
+    auto it = pellets.data.find(id);
+    if (it == pellets.data.end()) return;
+    auto region = regions.find(it->second.region);
+    if (region != regions.end()) region->second.pellets.erase(id);
+    pellets.remove(id);
+    changed_pellets.erase(id);
+    removed_pellets.insert(id);
+}
 
-    cast_pellets(newPellets);
+// Ids go out in drop order and a merge takes a new one, so the ones due to
+// expire are always at the front of the table.
+void Game::expire_pellets() {
+    while (!pellets.data.empty()) {
+        auto it = pellets.data.begin();
+        if (clock - it->second.t0 < pellet_lifetime) break;
+        remove_pellet(it->first);
+    }
 }
 
 
@@ -351,16 +959,18 @@ void Game::spawn_pellets(Player &player) {
 // -- Events
 // ----------------------------------------------------------------------------
 
-#define contains(x, y) (x.find(y) != x.end())
-
 void remove_client(i32 fd) {
     printf("[info] removing client %d\n", fd);
     nicepoll.erase(fd);
     clients.erase(fd);
     last_ping.erase(fd);
+    links.erase(fd);
+    link_latency.erase(fd);
+    pending_sync.erase(fd);
+    xclear(fd);
     if (contains(client_player, fd)) {
         Player &player = game.players.data[client_player[fd]];
-        xcast("log-left,"+player.nick);
+        cast<LogLeft>(player.nick);
         game.terminate_player(player);
         client_player.erase(fd);
     }
@@ -369,70 +979,169 @@ void remove_client(i32 fd) {
 void prune_clients() {
     vector<i32> to_remove;
     for (auto const& [fd, time] : last_ping) {
-        if (millis() - time > 10*1000)
+        if (millis() - time > 10*1000) {
+            metrics.pruned_timeout.add();
             to_remove.push_back(fd);
+        } else if (!xflush(fd)) {
+            metrics.pruned_overflow.add();
+            to_remove.push_back(fd);
+        }
     }
     for (i32 fd : to_remove) {
         remove_client(fd);
     }
 }
 
-bool handle_request(i32 fd, string &req) {
-    if (req.compare(0, 4, "ping") == 0) {
-        xsend(fd, "pong");
+Player *own_player(i32 fd) {
+    auto it = client_player.find(fd);
+    if (it == client_player.end()) return nullptr;
+    auto player = game.players.data.find(it->second);
+    if (player == game.players.data.end() || player->second.game_over) return nullptr;
+    return &player->second;
+}
 
-    } else if (req.compare(0, 4, "conn") == 0) {
-        //if (client_player.find(fd) != client_player.end()) return true;
-        //printf("[info] connect %d\n", fd);
+using RequestHandler = void (*)(i32 fd, Args &args);
 
-    } else if (req.compare(0, 4, "join") == 0) {
-        if (game.finished) {
-            printf("[warn] %d preparing for next game\n", fd);
-            return true;
-        }
-        if (contains(client_player, fd) && !game.players.data[client_player[fd]].game_over) {
-            printf("[warn] %d already joined\n", fd);
-            return true;
-        }
-        auto arg = split(2, req, ",");
-        auto nick = arg[1];
-        printf("[info] join %s %d\n", nick.c_str(), fd);
-        Player &player = game.spawn_player();
-        player.nick = nick;
-        player.fd = fd;
-        client_player[fd] = player.id;
-        send_all_particles(fd, game);
-        xcast("log-join,"+nick);
-        xsend(fd, "join,"+player.encode()+","+game.encode());
-
-    } else if (req.compare(0, 9, "usr-coord") == 0) {
-        auto arg = split(5, req, ",");
-        Player &player = game.players.data[I(arg[1])];
-        player.x = I(arg[2]);
-        player.y = I(arg[3]);
-        player.angle = I(arg[4]);
+void on_ping(i32 fd, Args &args) {
+    frame.clear();
+    if (args.more()) {
+        Stamped ping;
+        decode<Ping>(args, ping);
+        encode<Pong>(frame, ping);
+    } else {
+        encode<BarePong>(frame);
+    }
+    xsend_one(fd, frame);
+}
 
-    } else if (req.compare(0, 9, "usr-fired") == 0) {
-        auto arg = split(5, req, ",");
-        Bullet &bullet = game.spawn_bullet(I(arg[1]), I(arg[2]), I(arg[3]), I(arg[4]));
-        cast_bullet(bullet);
+// Answers to our own pings. Stamps from the future or from long ago are
+// someone else's clock, not a round trip.
+void on_pong(i32 fd, Args &args) {
+    Stamped pong;
+    decode<Pong>(args, pong);
+    u64 time = micros();
+    if (pong.stamp > time || time - pong.stamp > 60*1000*1000) return;
+    link_latency[fd].sample_rtt(time - pong.stamp);
+    metrics.latency.rtt.observe(time - pong.stamp);
+}
 
-    } else {
-        return false;
+// "conn,sim" asks for spawn records instead of per-entity updates.
+// "conn,watch" is a spectator without a ship, which gets the whole world.
+// "conn,relay[,token]" subscribes a relay, which gets the whole world again
+// every time it asks so it can bring new viewers up to date.
+void on_conn(i32 fd, Args &args) {
+    string_view mode = args.more() ? args.next<string_view>() : string_view();
+    string_view token = args.more() ? args.next<string_view>() : string_view();
+    bool relay = mode == "relay";
+    if (relay && !is_loopback(fd) && (relay_token.empty() || token != relay_token)) {
+        printf("[warn] refused relay %d\n", fd);
+        relay = false;
+    }
+    links[fd].sim = mode == "sim";
+    links[fd].relay = relay;
+    if ((relay || mode == "watch") && !contains(pending_sync, fd)) {
+        if (relay) printf("[info] relay subscribed %d\n", fd);
+        queue_all_particles(fd, game, map_size*500, map_size*500);
+    }
+}
 
+void on_join(i32 fd, Args &args) {
+    if (game.finished) {
+        printf("[warn] %d preparing for next game\n", fd);
+        return;
+    }
+    if (contains(client_player, fd) && !game.players.data[client_player[fd]].game_over) {
+        printf("[warn] %d already joined\n", fd);
+        return;
     }
+    JoinRequest join;
+    decode<Join>(args, join);
+    printf("[info] join %.*s %d\n", (i32) join.nick.size(), join.nick.data(), fd);
+    Player &player = game.spawn_player();
+    player.nick = join.nick;
+    player.fd = fd >= 0 ? fd : -1;
+    client_player[fd] = player.id;
+    cast<LogJoin>(player.nick);
+    frame.clear();
+    encode<Joined>(frame, player, game);
+    xsend_one(fd, frame);
+    if (fd >= 0) queue_all_particles(fd, game, player.x, player.y);
+}
+
+// The id is ignored, clients only ever steer their own ship.
+void on_coord(i32 fd, Args &args) {
+    SteerRequest steer;
+    decode<UsrCoord>(args, steer);
+    Player *player = own_player(fd);
+    if (player == nullptr) return;
+    player->x = clip(steer.x, 0, map_size*1000);
+    player->y = clip(steer.y, 0, map_size*1000);
+    player->angle = steer.angle;
+}
+
+// Bullets leave from where the server last saw the ship.
+void on_fired(i32 fd, Args &args) {
+    SteerRequest steer;
+    decode<UsrFired>(args, steer);
+    Player *player = own_player(fd);
+    if (player == nullptr) return;
+    Bullet &bullet = game.spawn_bullet(player->id, player->x, player->y, steer.angle);
+    cast_bullet(bullet);
+}
+
+// A simulating client disagreed with a world sum and dropped its rocks and
+// bullets, send them all again.
+void on_resync(i32 fd, Args &args) {
+    Player *player = own_player(fd);
+    if (player == nullptr) return;
+    queue_all_particles(fd, game, player->x, player->y);
+}
+
+RequestHandler request_handlers[command_count] = {};
+
+void init_request_handlers() {
+    request_handlers[CMD_PING] = &on_ping;
+    request_handlers[CMD_PONG] = &on_pong;
+    request_handlers[CMD_CONN] = &on_conn;
+    request_handlers[CMD_JOIN] = &on_join;
+    request_handlers[CMD_USR_COORD] = &on_coord;
+    request_handlers[CMD_USR_FIRED] = &on_fired;
+    request_handlers[CMD_USR_RESYNC] = &on_resync;
+}
 
+bool handle_request(i32 fd, Command command, string_view req) {
+    RequestHandler handler = request_handlers[command];
+    if (handler == nullptr) return false;
+    Args args{req.substr(command_names[command].size())};
+    handler(fd, args);
     return true;
 }
 
+bool handle_request(i32 fd, string_view req) {
+    return handle_request(fd, command_of(req), req);
+}
+
 void handle_client(i32 fd, u32 events) {
     if (events & EPOLLIN) {
-        last_ping[fd] = millis();
-        vector<string> reqs = xrecv(fd);
+        u64 time = millis();
+        u64 received = 0;
+        last_ping[fd] = time;
+        Link &link = links[fd];
+        vector<string> reqs = xrecv(fd, &received);
         for (string req : reqs) {
+            Command command = count_in(req);
+            if (!link.buckets[limit_of(command)].take(time)) {
+                metrics.throttled[command].add();
+                continue;
+            }
             try {
-                handle_request(fd, req);
+                if (handle_request(fd, command, req)) {
+                    link.arrivals.push_back(received);
+                } else {
+                    metrics.unknown_requests.add();
+                }
             } catch (const char*e) {
+                metrics.parse_errors.add();
                 printf("[warn] exception during request - %s\n", req.c_str());
             }
         }
@@ -442,6 +1151,18 @@ void handle_client(i32 fd, u32 events) {
     }
 }
 
+Link &open_client(i32 fd) {
+    clients.insert(fd);
+    last_ping[fd] = millis();
+    Link &link = links[fd];
+    link = Link{};
+    make_timestamped(fd);
+    for (i32 i = 0; i < LIMIT_COUNT; i++)
+        link.buckets[i] = TokenBucket(rates[i].rate, rates[i].burst, millis());
+    nicepoll.insert(fd, EPOLLIN | EPOLLRDHUP, &handle_client);
+    return link;
+}
+
 void handle_server(i32 fd, u32 events) {
     if (events & EPOLLIN) {
         sockaddr_in client_addr{};
@@ -457,10 +1178,493 @@ void handle_server(i32 fd, u32 events) {
         i32 port = ntohs(client_addr.sin_port);
         printf("[info] new connection from: %s:%hu (fd: %d)\n", addr, port, client);
 
-        clients.insert(client);
-        last_ping[client] = millis();
-        nicepoll.insert(client, EPOLLIN | EPOLLRDHUP, &handle_client);
+        if (make_nonblocking(client) < 0) {
+            cerr << "[warn] couldn't make client non-blocking" << endl;
+            close(client);
+            return;
+        }
+
+        open_client(client);
+    }
+}
+
+
+// Requests change the world right away, but nobody sees the change until the
+// next tick simulates and sends it, which is when they count as applied.
+void stamp_applied() {
+    u64 time = micros();
+    for (auto &[fd, link] : links) {
+        if (link.arrivals.empty()) continue;
+        Latency &latency = link_latency[fd];
+        for (u64 received : link.arrivals) {
+            latency.inbound.observe(time - received);
+            metrics.latency.inbound.observe(time - received);
+        }
+        link.arrivals.clear();
+    }
+}
+
+void stamp_written(i32 fd, u64 waited) {
+    auto it = link_latency.find(fd);
+    if (it != link_latency.end()) it->second.outbound.observe(waited);
+    metrics.latency.outbound.observe(waited);
+}
+
+
+// ----------------------------------------------------------------------------
+// -- Bots
+// ----------------------------------------------------------------------------
+
+// Bots are players without a socket. They act by feeding handle_request the
+// same requests a real client sends, under a connection id below -1 so they
+// never collide with a descriptor. Everything a bot decides comes from its
+// own seeded generator and what it sees of the world, so with --fixed-tick
+// and no real clients, the same seeds replay the same match.
+
+const i32 BOT_THINK = 500;
+const i32 BOT_SYNC = 20;
+const i32 BOT_RELOAD = 400;
+const i32 BOT_REJOIN = 3*1000;
+const i32 BOT_SIGHT = 300*1000;
+// Same as the client: milli-units and milliradians per milli.
+const i32 BOT_MOVE_SPEED = 150;
+const i32 BOT_TURN_SPEED = 3;
+
+struct Bot {
+    i32 conn;
+    SplitMix rng;
+    i32 target_x = 0, target_y = 0;
+    i32 think = 0, sync = 0, reload = 0, rejoin = 0;
+    string request;
+};
+
+i32 bot_count = 0;
+u64 bot_seed = 1;
+vector<Bot> bots;
+
+// Millis simulated per step, 0 steps by however long the wall clock says.
+i32 fixed_tick = 0;
+
+// Bots taken over from the old process keep playing, new ones top them up.
+void spawn_bots() {
+    for (i32 i = bots.size(); i < bot_count; i++) {
+        bots.push_back(Bot{-2 - i, SplitMix{bot_seed * 0x9E3779B97F4A7C15ull + i}});
+    }
+    if (bot_count > 0) printf("[info] spawned %d bots (seed %lu)\n", bot_count, bot_seed);
+}
+
+template <class Msg, class T>
+void bot_request(Bot &bot, const T &request) {
+    bot.request.clear();
+    encode<Msg>(bot.request, request);
+    try {
+        handle_request(bot.conn, Msg::command, bot.request);
+    } catch (const char *e) {
+        printf("[warn] bot request failed - %s\n", bot.request.c_str());
+    }
+}
+
+// Head for the nearest pellet in sight, or wander somewhere close by.
+void bot_think(Bot &bot, Player &player) {
+    i64 best = (i64)BOT_SIGHT * BOT_SIGHT;
+    bool found = false;
+    game.near_pellets(player.x, player.y, [&](Pellet &pellet) {
+        i64 d = idistsq(player.x, player.y, pellet.x, pellet.y);
+        if (d < best) {
+            best = d;
+            bot.target_x = pellet.x;
+            bot.target_y = pellet.y;
+            found = true;
+        }
+        return false;
+    });
+    if (!found) {
+        bot.target_x = clip(player.x + bot.rng.uniform(-BOT_SIGHT, BOT_SIGHT), 0, map_size*1000);
+        bot.target_y = clip(player.y + bot.rng.uniform(-BOT_SIGHT, BOT_SIGHT), 0, map_size*1000);
+    }
+}
+
+void drive_bot(Bot &bot, i32 dt) {
+    Player *player = own_player(bot.conn);
+    if (player == nullptr) {
+        if (game.finished) return;
+        bot.rejoin -= dt;
+        if (bot.rejoin > 0) return;
+        bot.rejoin = BOT_REJOIN;
+        bot.think = 0;
+        string nick = "bot-"+S(-bot.conn - 2);
+        bot_request<Join>(bot, JoinRequest{nick});
+        return;
+    }
+
+    bot.think -= dt;
+    if (bot.think <= 0) {
+        bot.think = BOT_THINK;
+        bot_think(bot, *player);
+    }
+
+    bot.sync -= dt;
+    if (bot.sync <= 0) {
+        i32 step = max(BOT_SYNC - bot.sync, 0);
+        bot.sync = BOT_SYNC;
+
+        // Turn towards the target by the sign of the cross product.
+        i64 hx = fcos(player->angle), hy = fsin(player->angle);
+        i64 tx = bot.target_x - player->x, ty = bot.target_y - player->y;
+        i64 cross = hx * ty - hy * tx;
+        i32 turn = step * BOT_TURN_SPEED;
+        i32 angle = (player->angle + (cross > 0 ? turn : cross < 0 ? -turn : 0) + turn_milli) % turn_milli;
+        i32 x = player->x + advance(step, BOT_MOVE_SPEED, fcos(angle));
+        i32 y = player->y + advance(step, BOT_MOVE_SPEED, fsin(angle));
+        bot_request<UsrCoord>(bot, SteerRequest{player->id, x, y, angle});
+    }
+
+    bot.reload -= dt;
+    if (bot.reload <= 0) {
+        bool rock_near = false;
+        game.near_rocks(player->x, player->y, [&](Rock &rock) {
+            rock_near = within(player->x, player->y, rock.x, rock.y, BOT_SIGHT);
+            return rock_near;
+        });
+        if (rock_near || bot.rng.uniform(0, 9) == 0) {
+            bot.reload = BOT_RELOAD;
+            bot_request<UsrFired>(bot, SteerRequest{player->id, player->x, player->y, player->angle});
+        } else {
+            bot.reload = BOT_RELOAD / 2;
+        }
+    }
+}
+
+void drive_bots(i32 dt) {
+    for (Bot &bot : bots) drive_bot(bot, dt);
+}
+
+
+// ----------------------------------------------------------------------------
+// -- Metrics endpoint
+// ----------------------------------------------------------------------------
+
+// Scrapes are answered through the outbox like any other socket, so a big
+// response or a scraper that stops reading never holds up the tick.
+struct Scrape {
+    u64 since;
+    bool answered = false;
+};
+
+map<i32, Scrape> scrapes;
+
+// A scrape that hasn't drained by then is dropped.
+const u64 SCRAPE_TIMEOUT = 5*1000;
+
+void remove_scrape(i32 fd) {
+    nicepoll.erase(fd);
+    scrapes.erase(fd);
+    xclear(fd);
+}
+
+// "GET /links" gets per-connection latency, any other request the full
+// text exposition, then the connection is closed once it's written.
+void handle_metrics_client(i32 fd, u32 events) {
+    Scrape &scrape = scrapes[fd];
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        remove_scrape(fd);
+        return;
+    }
+    if (events & EPOLLIN) {
+        char buffer[1024];
+        i64 length = read(fd, buffer, sizeof(buffer));
+        if (length < 0 && errno != EAGAIN) {
+            remove_scrape(fd);
+            return;
+        }
+        if (length == 0) events |= EPOLLRDHUP;
+        // Anything after the request line is read and ignored.
+        if (length > 0 && !scrape.answered) {
+            string &res = outbox[fd];
+            if (string_view(buffer, length).compare(0, 10, "GET /links") == 0) {
+                res = http_response(render_links(link_latency));
+            } else {
+                u64 queued = 0;
+                for (i32 client : clients) queued += xqueued(client);
+                res = http_response(render_metrics(game, clients.size(), queued));
+            }
+            scrape.answered = true;
+            xflush(fd);
+        }
+    }
+    // Scrapers may shut down their side once the request is sent. The
+    // answer still goes out, flush_scrapes closes it once it's written.
+    if (events & EPOLLRDHUP) {
+        if (!scrape.answered) {
+            remove_scrape(fd);
+            return;
+        }
+        nicepoll.modify(fd, 0, &handle_metrics_client);
+    }
+    if (scrape.answered && !contains(outbox, fd)) remove_scrape(fd);
+}
+
+void flush_scrapes() {
+    vector<i32> to_remove;
+    u64 time = millis();
+    for (auto const& [fd, scrape] : scrapes) {
+        bool flushed = xflush(fd);
+        bool done = scrape.answered && !contains(outbox, fd);
+        if (!flushed || done || time - scrape.since > SCRAPE_TIMEOUT)
+            to_remove.push_back(fd);
+    }
+    for (i32 fd : to_remove) remove_scrape(fd);
+}
+
+void handle_metrics_server(i32 fd, u32 events) {
+    if (events & EPOLLIN) {
+        i32 client = accept(fd, nullptr, nullptr);
+        if (client < 0) return;
+        if (make_nonblocking(client) < 0) {
+            close(client);
+            return;
+        }
+        scrapes[client] = {millis()};
+        nicepoll.insert(client, EPOLLIN | EPOLLRDHUP, &handle_metrics_client);
+    }
+}
+
+void listen_metrics() {
+    i32 server = socket(AF_INET, SOCK_STREAM, 0);
+    if (server < 0)
+        fatal("could not create metrics socket");
+
+    if (make_reusable(server) < 0 || make_nonblocking(server) < 0)
+        fatal("could not configure metrics socket");
+
+    sockaddr_in addr{AF_INET, htons(metrics_port), {htonl(INADDR_LOOPBACK)}};
+    if (bind(server, (sockaddr*) &addr, sizeof(addr)) < 0)
+        fatal("could not bind metrics socket");
+
+    if (listen(server, 8) < 0)
+        fatal("could not listen on metrics socket");
+
+    printf("[info] serving metrics on 127.0.0.1:%d\n", metrics_port);
+    metrics_fd = server;
+    nicepoll.insert(server, EPOLLIN, &handle_metrics_server);
+}
+
+
+// ----------------------------------------------------------------------------
+// -- Takeover
+// ----------------------------------------------------------------------------
+
+// A new binary started with --takeover connects to the old one's control
+// socket. The old process checkpoints the match and every connection into a
+// mapped file, passes its sockets over with SCM_RIGHTS and exits, and the new
+// one picks up ticking where it left off.
+
+// The descriptor count goes up front, the new process needs it to collect
+// every batch before it loads anything.
+void save_server(Writer &out, const vector<i32> &fds) {
+    out.put(checkpoint_magic);
+    out.put(checkpoint_version);
+    out.put((u32) fds.size());
+    save_game(out, game);
+    out.put(server_fd);
+    out.put(metrics_fd);
+    for (i32 fd : fds) out.put(fd);
+
+    out.put((u32) clients.size());
+    for (i32 fd : clients) {
+        out.put(fd);
+        out.put(contains(client_player, fd) ? client_player[fd] : -1);
+        out.put(links[fd].level);
+        out.put(links[fd].sim);
+        out.put(links[fd].relay);
+        out.put(contains(inbox, fd) ? inbox[fd] : string());
+        out.put(contains(outbox, fd) ? outbox[fd] : string());
+        vector<Sync> &sync = pending_sync[fd];
+        out.put((u32) sync.size());
+        for (Sync entry : sync) out.put(entry);
+        if (sync.empty()) pending_sync.erase(fd);
+    }
+
+    // Bots have no socket, only their player binding and their own state.
+    out.put((u32) bots.size());
+    for (const Bot &bot : bots) {
+        out.put(bot.conn);
+        out.put(contains(client_player, bot.conn) ? client_player[bot.conn] : -1);
+        out.put(bot.rng);
+        out.put(bot.target_x); out.put(bot.target_y);
+        out.put(bot.think); out.put(bot.sync); out.put(bot.reload); out.put(bot.rejoin);
+    }
+}
+
+u32 peek_fd_count(Reader &in) {
+    if (in.get<u32>() != checkpoint_magic) throw "not a checkpoint";
+    if (in.get<u32>() != checkpoint_version) throw "unsupported checkpoint version";
+    return in.get<u32>();
+}
+
+void load_server(Reader &in, const vector<i32> &fds) {
+    u32 count = peek_fd_count(in);
+    if (count != fds.size()) throw "descriptor count mismatch";
+    game = load_game(in);
+    i32 old_server = in.get<i32>();
+    i32 old_metrics = in.get<i32>();
+
+    map<i32, i32> renamed;
+    for (u32 i = 0; i < count; i++) renamed[in.get<i32>()] = fds[i];
+    server_fd = renamed[old_server];
+    if (old_metrics >= 0) metrics_fd = renamed[old_metrics];
+
+    for (auto &[id, player] : game.players.data) {
+        if (player.fd >= 0) player.fd = contains(renamed, player.fd) ? renamed[player.fd] : -1;
+    }
+
+    u32 client_count = in.get<u32>();
+    for (u32 i = 0; i < client_count; i++) {
+        i32 fd = renamed[in.get<i32>()];
+        i32 player_id = in.get<i32>();
+        i32 level = in.get<i32>();
+        bool sim = in.get<bool>();
+        bool relay = in.get<bool>();
+        string pending_in = in.get_string();
+        string pending_out = in.get_string();
+        u32 sync_count = in.get<u32>();
+
+        Link &link = open_client(fd);
+        link.level = level;
+        link.sim = sim;
+        link.relay = relay;
+        if (player_id >= 0) client_player[fd] = player_id;
+        if (!pending_in.empty()) inbox[fd] = pending_in;
+        if (!pending_out.empty()) outbox[fd] = pending_out;
+        for (u32 j = 0; j < sync_count; j++) pending_sync[fd].push_back(in.get<Sync>());
+    }
+
+    u32 bot_total = in.get<u32>();
+    for (u32 i = 0; i < bot_total; i++) {
+        Bot bot;
+        bot.conn = in.get<i32>();
+        i32 player_id = in.get<i32>();
+        if (player_id >= 0) client_player[bot.conn] = player_id;
+        bot.rng = in.get<SplitMix>();
+        bot.target_x = in.get<i32>(); bot.target_y = in.get<i32>();
+        bot.think = in.get<i32>(); bot.sync = in.get<i32>(); bot.reload = in.get<i32>(); bot.rejoin = in.get<i32>();
+        bots.push_back(bot);
+    }
+}
+
+void handle_control_client(i32 fd, u32 events) {
+    if (!(events & EPOLLIN)) {
+        nicepoll.erase(fd);
+        return;
+    }
+
+    char buffer[1024] = {};
+    i32 length = read(fd, buffer, sizeof(buffer) - 1);
+    string req(buffer, max(length, 0));
+    if (req.compare(0, 9, "takeover,") != 0) {
+        nicepoll.erase(fd);
+        return;
+    }
+    // The checkpoint only ever goes where this server was told to put it,
+    // the new process has to be started with the same --checkpoint.
+    string path = req.substr(9, req.find('\n') - 9);
+    if (path != checkpoint_path) {
+        printf("[warn] takeover wants checkpoint %s, this server writes %s\n", path.c_str(), checkpoint_path.c_str());
+        nicepoll.erase(fd);
+        return;
+    }
+
+    for (i32 client : clients) xflush(client);
+
+    vector<i32> fds = {server_fd};
+    if (metrics_fd >= 0) fds.push_back(metrics_fd);
+    for (i32 client : clients) fds.push_back(client);
+
+    Writer out;
+    save_server(out, fds);
+    if (!write_mapped(path, out.data) || !send_fds(fd, fds)) {
+        printf("[warn] takeover to %s failed, still serving\n", path.c_str());
+        nicepoll.erase(fd);
+        return;
+    }
+
+    // The sockets now live on in the new process, so leave without shutting
+    // any of them down.
+    printf("[info] handed over %lu clients via %s (%lu bytes)\n", clients.size(), path.c_str(), out.data.size());
+    exit(0);
+}
+
+void handle_control_server(i32 fd, u32 events) {
+    if (events & EPOLLIN) {
+        i32 client = accept(fd, nullptr, nullptr);
+        if (client < 0) return;
+        // Taking over hands out every client socket, only our own user may.
+        if (!is_same_user(client)) {
+            printf("[warn] refused takeover from another user\n");
+            close(client);
+            return;
+        }
+        nicepoll.insert(client, EPOLLIN | EPOLLRDHUP, &handle_control_client);
+    }
+}
+
+void listen_control() {
+    sockaddr_un addr;
+    i32 server = unix_socket(control_path, addr);
+    if (server < 0)
+        fatal("could not create control socket");
+
+    // Created owner-only from the start rather than chmod'ed after bind.
+    unlink(control_path.c_str());
+    mode_t mask = umask(0177);
+    i32 bound = bind(server, (sockaddr*) &addr, sizeof(addr));
+    umask(mask);
+    if (bound < 0)
+        fatal("could not bind control socket");
+
+    if (listen(server, 1) < 0)
+        fatal("could not listen on control socket");
+
+    printf("[info] accepting takeovers on %s\n", control_path.c_str());
+    nicepoll.insert(server, EPOLLIN, &handle_control_server);
+}
+
+void takeover() {
+    sockaddr_un addr;
+    i32 sock = unix_socket(takeover_path, addr);
+    if (sock < 0 || connect(sock, (sockaddr*) &addr, sizeof(addr)) < 0)
+        fatal("could not reach the running server");
+
+    string req = "takeover," + checkpoint_path + "\n";
+    if (send(sock, req.data(), req.size(), MSG_NOSIGNAL) != (i64) req.size())
+        fatal("could not request takeover");
+
+    vector<i32> fds;
+    if (!recv_fds(sock, fds))
+        fatal("could not receive sockets");
+
+    MappedFile file;
+    if (!file.open(checkpoint_path))
+        fatal("could not map checkpoint");
+
+    // The checkpoint is complete before the first batch is sent, so it says
+    // how many more batches to wait for.
+    Reader in = file.reader();
+    try {
+        Reader peek = file.reader();
+        u32 count = peek_fd_count(peek);
+        while (fds.size() < count) {
+            if (!recv_fds(sock, fds))
+                fatal("could not receive sockets");
+        }
+        close(sock);
+        load_server(in, fds);
+    } catch (const char *e) {
+        fatal(e);
     }
+    nicepoll.insert(server_fd, EPOLLIN, &handle_server);
+    if (metrics_fd >= 0) nicepoll.insert(metrics_fd, EPOLLIN, &handle_metrics_server);
+    printf("[info] took over %lu clients from %s\n", clients.size(), takeover_path.c_str());
 }
 
 
@@ -476,6 +1680,15 @@ void parse_args(int argc, char **argv) {
         printf("  --map-size   INT\n");
         printf("  --game-time  MILLIS\n");
         printf("  --reset-time MILLIS\n");
+        printf("  --seed       INT\n");
+        printf("  --bots       INT   number of server-side bot players\n");
+        printf("  --bot-seed   INT\n");
+        printf("  --fixed-tick MILLIS  simulate in steps of exactly this long\n");
+        printf("  --relay-token TOKEN  lets relays from other machines subscribe\n");
+        printf("  --metrics-port PORT\n");
+        printf("  --control    PATH  accept takeovers on this UNIX socket\n");
+        printf("  --takeover   PATH  take over from the server controlled at PATH\n");
+        printf("  --checkpoint PATH\n");
         exit(1);
     }
 
@@ -491,15 +1704,39 @@ void parse_args(int argc, char **argv) {
 
         } else if (strcmp(argv[i],"--map-size")==0) {
             map_size = atoi(argv[++i]);
+
+        } else if (strcmp(argv[i],"--seed")==0) {
+            world_seed = strtoull(argv[++i], nullptr, 10);
+            gen.seed(world_seed);
+
+        } else if (strcmp(argv[i],"--bots")==0) {
+            bot_count = atoi(argv[++i]);
+
+        } else if (strcmp(argv[i],"--bot-seed")==0) {
+            bot_seed = strtoull(argv[++i], nullptr, 10);
+
+        } else if (strcmp(argv[i],"--fixed-tick")==0) {
+            fixed_tick = max(atoi(argv[++i]), 0);
+
+        } else if (strcmp(argv[i],"--relay-token")==0) {
+            relay_token = argv[++i];
+
+        } else if (strcmp(argv[i],"--metrics-port")==0) {
+            metrics_port = atoi(argv[++i]);
+
+        } else if (strcmp(argv[i],"--control")==0) {
+            control_path = argv[++i];
+
+        } else if (strcmp(argv[i],"--takeover")==0) {
+            takeover_path = argv[++i];
+
+        } else if (strcmp(argv[i],"--checkpoint")==0) {
+            checkpoint_path = argv[++i];
         }
     }
 }
 
-int main(int argc, char **argv) {
-    const i32 max_pending = 32;
-    const u32 max_events = 8;
-
-    parse_args(argc, argv);
+i32 listen_game(i32 max_pending) {
     i32 server = socket(AF_INET, SOCK_STREAM, 0);
     if (server < 0)
         fatal("could not create socket");
@@ -518,29 +1755,64 @@ int main(int argc, char **argv) {
         fatal("could not listen on socket");
 
     printf("[info] listening on port %d\n", port);
+    return server;
+}
+
+int main(int argc, char **argv) {
+    const i32 max_pending = 32;
+    const u32 max_events = 8;
+
+    parse_args(argc, argv);
     if (nicepoll.create() < 0)
         fatal("could not create epoll descriptor");
 
-    nicepoll.insert(server, EPOLLIN, &handle_server);
+    if (!takeover_path.empty()) {
+        takeover();
+    } else {
+        server_fd = listen_game(max_pending);
+        nicepoll.insert(server_fd, EPOLLIN, &handle_server);
+        if (metrics_port > 0) listen_metrics();
+        resetGame();
+    }
+    if (!control_path.empty()) listen_control();
+    xwrite_hook = &stamp_written;
+    init_request_handlers();
+    spawn_bots();
 
     epoll_event events[max_events];
 
-    resetGame();
     auto t0 = now();
     while (true) {
         i32 event_count = nicepoll.wait(events, 1, 10);
         for (i32 i = 0; i < event_count; i++) {
             nicepoll.handle(events[i]);
         }
+        auto tick_start = now();
         prune_clients();
+        flush_scrapes();
         if (game.reset) {
             resetGame();
         }
-        game.step(millis(now() - t0));
-        t0 = now();
-        cast_game_updates(game);
-
-        for (i32 fd : clients) send_world_updates(fd, game);
+        // Keep the leftover fraction of a milli for the next tick.
+        i32 dt = millis(now() - t0);
+        if (fixed_tick > 0) {
+            if (dt < fixed_tick) continue;
+            // More than a second behind, the backlog is dropped.
+            if (dt > 1000) t0 = now() - chrono::milliseconds(fixed_tick);
+            dt = fixed_tick;
+        }
+        t0 += chrono::milliseconds(dt);
+        stamp_applied();
+        drive_bots(dt);
+        game.step(dt);
+        cast_pellet_changes(game);
+        send_snapshots(game);
+        send_pending_sync(game);
+        if (game.clock - last_world_sum >= WORLD_SUM_PERIOD) {
+            last_world_sum = game.clock;
+            cast_world_sum(game);
+        }
+        metrics.tick_micros.observe(chrono::duration_cast<chrono::microseconds>(now() - tick_start).count());
     }
 }
 
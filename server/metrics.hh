@@ -0,0 +1,234 @@
+#pragma once
+
+#include <atomic>
+
+#include "protocol.hh"
+
+//
+// Primitives
+//
+
+// Everything is updated with relaxed atomics, so recording never blocks and
+// a scrape only ever sees slightly stale values.
+
+struct Counter {
+    atomic<u64> value{0};
+
+    inline void add(u64 n = 1) {
+        value.fetch_add(n, memory_order_relaxed);
+    }
+
+    inline u64 get() const {
+        return value.load(memory_order_relaxed);
+    }
+};
+
+template <u32 N>
+struct Histogram {
+    u64 bounds[N];
+    atomic<u64> buckets[N + 1] = {};
+    atomic<u64> sum{0};
+    atomic<u64> count{0};
+
+    inline void observe(u64 value) {
+        u32 i = 0;
+        while (i < N && value > bounds[i]) i++;
+        buckets[i].fetch_add(1, memory_order_relaxed);
+        sum.fetch_add(value, memory_order_relaxed);
+        count.fetch_add(1, memory_order_relaxed);
+    }
+
+    // Upper bound of the bucket holding the q-th quantile, the last bound if
+    // it's past all of them.
+    inline u64 quantile(f64 q) const {
+        u64 total = count.load(memory_order_relaxed);
+        u64 seen = 0;
+        for (u32 i = 0; i < N; i++) {
+            seen += buckets[i].load(memory_order_relaxed);
+            if (seen >= q * total) return bounds[i];
+        }
+        return bounds[N - 1];
+    }
+};
+
+// Where time goes between a client and the simulation, in micros: the round
+// trip of our pings, how long a request waits for the tick that applies it
+// and how long a frame waits between xsend and its last byte being written.
+struct Latency {
+    Histogram<12> rtt = latency_histogram();
+    Histogram<12> inbound = latency_histogram();
+    Histogram<12> outbound = latency_histogram();
+    // Smoothed like TCP's srtt, only kept per connection.
+    atomic<u64> srtt{0};
+
+    inline void sample_rtt(u64 value) {
+        rtt.observe(value);
+        u64 old = srtt.load(memory_order_relaxed);
+        srtt.store(old == 0 ? value : old - old / 8 + value / 8, memory_order_relaxed);
+    }
+
+    static inline Histogram<12> latency_histogram() {
+        return {{250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000}};
+    }
+};
+
+
+//
+// Registry
+//
+
+struct Metrics {
+    Histogram<10> tick_micros{{100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000}};
+    Histogram<8> queued_bytes{{1<<10, 4<<10, 16<<10, 64<<10, 256<<10, 1<<20, 4<<20, 16<<20}};
+    Latency latency;
+
+    Counter messages_in[command_count];
+    Counter messages_out[command_count];
+    Counter bytes_in[command_count];
+    Counter bytes_out[command_count];
+
+    Counter throttled[command_count];
+    Counter parse_errors;
+    Counter unknown_requests;
+    Counter pruned_timeout;
+    Counter pruned_overflow;
+};
+
+Metrics metrics;
+
+inline Command count_in(string_view msg) {
+    Command i = command_of(msg);
+    metrics.messages_in[i].add();
+    metrics.bytes_in[i].add(msg.size() + 1);
+    return i;
+}
+
+// Frames may batch several messages separated by ';'. A frame going to
+// several clients is counted once, for all of its copies.
+inline void count_out(const string &frame, u64 copies = 1) {
+    if (copies == 0 || frame.empty()) return;
+    u64 start = 0;
+    while (start <= frame.size()) {
+        u64 end = frame.find(';', start);
+        if (end == string::npos) end = frame.size();
+        string_view msg(frame.data() + start, end - start);
+        Command i = command_of(msg);
+        metrics.messages_out[i].add(copies);
+        metrics.bytes_out[i].add((msg.size() + 1) * copies);
+        start = end + 1;
+    }
+}
+
+
+//
+// Exposition
+//
+
+inline void render_counter(string &out, const char *name, const char *help, u64 value) {
+    out += "# HELP "; out += name; out += " "; out += help; out += "\n";
+    out += "# TYPE "; out += name; out += " counter\n";
+    out += name; out += " " + S(value) + "\n";
+}
+
+inline void render_gauge(string &out, const char *name, const char *help, u64 value) {
+    out += "# HELP "; out += name; out += " "; out += help; out += "\n";
+    out += "# TYPE "; out += name; out += " gauge\n";
+    out += name; out += " " + S(value) + "\n";
+}
+
+inline void render_commands(string &out, const char *name, const char *help, Counter *counters) {
+    out += "# HELP "; out += name; out += " "; out += help; out += "\n";
+    out += "# TYPE "; out += name; out += " counter\n";
+    for (u32 i = 0; i < command_count; i++) {
+        out += name; out += "{command=\""; out += command_names[i]; out += "\"} ";
+        out += S(counters[i].get()) + "\n";
+    }
+}
+
+template <u32 N>
+inline void render_histogram(string &out, const char *name, const char *help, Histogram<N> &hist) {
+    out += "# HELP "; out += name; out += " "; out += help; out += "\n";
+    out += "# TYPE "; out += name; out += " histogram\n";
+    u64 total = 0;
+    for (u32 i = 0; i <= N; i++) {
+        total += hist.buckets[i].load(memory_order_relaxed);
+        out += name; out += "_bucket{le=\"";
+        out += i < N ? S(hist.bounds[i]) : "+Inf";
+        out += "\"} " + S(total) + "\n";
+    }
+    out += name; out += "_sum " + S(hist.sum.load(memory_order_relaxed)) + "\n";
+    out += name; out += "_count " + S(hist.count.load(memory_order_relaxed)) + "\n";
+}
+
+inline void render_entities(string &out, const Game &game) {
+    out += "# HELP galactica_entities Live entities per table\n";
+    out += "# TYPE galactica_entities gauge\n";
+    out += "galactica_entities{table=\"players\"} " + S(game.players.data.size()) + "\n";
+    out += "galactica_entities{table=\"rocks\"} " + S(game.rocks.data.size()) + "\n";
+    out += "galactica_entities{table=\"bullets\"} " + S(game.bullets.data.size()) + "\n";
+    out += "galactica_entities{table=\"pellets\"} " + S(game.pellets.data.size()) + "\n";
+}
+
+inline string render_metrics(const Game &game, u64 clients, u64 queued) {
+    string out;
+    out.reserve(16*1024);
+    render_histogram(out, "galactica_tick_micros", "Time spent simulating and sending one tick", metrics.tick_micros);
+    render_entities(out, game);
+    render_gauge(out, "galactica_clients", "Connected clients", clients);
+    render_gauge(out, "galactica_outbound_queued_bytes", "Bytes waiting to be sent across all clients", queued);
+    render_histogram(out, "galactica_link_queued_bytes", "Per-client outbound queue depth at each link probe", metrics.queued_bytes);
+    render_histogram(out, "galactica_rtt_micros", "Round trip of server pings", metrics.latency.rtt);
+    render_histogram(out, "galactica_inbound_wait_micros", "From reading a request to the tick that applies it", metrics.latency.inbound);
+    render_histogram(out, "galactica_outbound_wait_micros", "From queueing a frame to writing its last byte", metrics.latency.outbound);
+    render_commands(out, "galactica_messages_in_total", "Messages received per command", metrics.messages_in);
+    render_commands(out, "galactica_bytes_in_total", "Bytes received per command", metrics.bytes_in);
+    render_commands(out, "galactica_messages_out_total", "Messages sent per command", metrics.messages_out);
+    render_commands(out, "galactica_bytes_out_total", "Bytes sent per command", metrics.bytes_out);
+    render_commands(out, "galactica_throttled_total", "Requests dropped by per-client rate limits", metrics.throttled);
+    render_counter(out, "galactica_parse_errors_total", "Requests that failed to parse", metrics.parse_errors.get());
+    render_counter(out, "galactica_unknown_requests_total", "Requests with an unknown command", metrics.unknown_requests.get());
+    render_counter(out, "galactica_pruned_timeout_total", "Clients dropped for not pinging", metrics.pruned_timeout.get());
+    render_counter(out, "galactica_pruned_overflow_total", "Clients dropped for an overflowing outbox", metrics.pruned_overflow.get());
+    return out;
+}
+
+// Per-connection latency is too many series for a scrape, it's rendered on
+// request as summaries labelled by descriptor.
+inline void render_summary_head(string &out, const char *name, const char *help) {
+    out += "# HELP "; out += name; out += " "; out += help; out += "\n";
+    out += "# TYPE "; out += name; out += " summary\n";
+}
+
+template <u32 N>
+inline void render_summary(string &out, const char *name, i32 fd, Histogram<N> &hist) {
+    for (f64 q : {0.5, 0.9, 0.99}) {
+        out += name; out += "{fd=\"" + S(fd) + "\",quantile=\"";
+        out += q == 0.5 ? "0.5" : q == 0.9 ? "0.9" : "0.99";
+        out += "\"} " + S(hist.quantile(q)) + "\n";
+    }
+    out += name; out += "_sum{fd=\"" + S(fd) + "\"} " + S(hist.sum.load(memory_order_relaxed)) + "\n";
+    out += name; out += "_count{fd=\"" + S(fd) + "\"} " + S(hist.count.load(memory_order_relaxed)) + "\n";
+}
+
+inline string render_links(map<i32, Latency> &links) {
+    string out;
+    render_summary_head(out, "galactica_link_rtt_micros", "Round trip of server pings per connection");
+    for (auto &[fd, latency] : links) render_summary(out, "galactica_link_rtt_micros", fd, latency.rtt);
+    render_summary_head(out, "galactica_link_inbound_wait_micros", "Request wait for its tick per connection");
+    for (auto &[fd, latency] : links) render_summary(out, "galactica_link_inbound_wait_micros", fd, latency.inbound);
+    render_summary_head(out, "galactica_link_outbound_wait_micros", "Frame wait for its last byte per connection");
+    for (auto &[fd, latency] : links) render_summary(out, "galactica_link_outbound_wait_micros", fd, latency.outbound);
+    out += "# HELP galactica_link_srtt_micros Smoothed round trip of server pings per connection\n";
+    out += "# TYPE galactica_link_srtt_micros gauge\n";
+    for (auto &[fd, latency] : links) {
+        out += "galactica_link_srtt_micros{fd=\"" + S(fd) + "\"} " + S(latency.srtt.load(memory_order_relaxed)) + "\n";
+    }
+    return out;
+}
+
+inline string http_response(const string &body) {
+    return "HTTP/1.1 200 OK\r\n"
+           "Content-Type: text/plain; version=0.0.4\r\n"
+           "Content-Length: " + S(body.size()) + "\r\n"
+           "Connection: close\r\n\r\n" + body;
+}
@@ -0,0 +1,276 @@
+#pragma once
+
+#include <charconv>
+#include <string_view>
+#include <type_traits>
+
+#include "game.hh"
+
+//
+// Commands
+//
+
+// Every message on the wire is "command,field,field,..." and frames batch
+// several messages separated by ';'. Requests from clients and events from
+// the server share one command space.
+
+enum Command : u32 {
+    CMD_PING, CMD_PONG, CMD_CONN, CMD_JOIN, CMD_USR_COORD, CMD_USR_FIRED, CMD_USR_RESYNC,
+    CMD_STAT_GAME, CMD_STAT_SHIP, CMD_STAT_ROCK, CMD_STAT_BULLET, CMD_STAT_PELLET,
+    CMD_NEW_ROCK, CMD_NEW_BULLET, CMD_SUM_WORLD, CMD_SYNC_WORLD,
+    CMD_DEL_SHIP, CMD_DEL_ROCK, CMD_DEL_BULLET, CMD_DEL_PELLET,
+    CMD_LOG_JOIN, CMD_LOG_LEFT, CMD_LOG_DEAD, CMD_LOG_WIN,
+    CMD_GAME_OVER, CMD_GOT_HIT, CMD_OTHER,
+};
+
+constexpr string_view command_names[] = {
+    "ping", "pong", "conn", "join", "usr-coord", "usr-fired", "usr-resync",
+    "stat-game", "stat-ship", "stat-rock", "stat-bullet", "stat-pellet",
+    "new-rock", "new-bullet", "sum-world", "sync-world",
+    "del-ship", "del-rock", "del-bullet", "del-pellet",
+    "log-join", "log-left", "log-dead", "log-win",
+    "game-over", "got-hit", "other",
+};
+
+const u32 command_count = sizeof(command_names) / sizeof(command_names[0]);
+static_assert(command_count == CMD_OTHER + 1, "command_names out of step with Command");
+
+// Commands are looked up through a perfect hash: the seed is searched for at
+// compile time until every name lands in its own slot, so a lookup is one
+// hash and one compare.
+
+const u32 command_slots = 128;
+
+constexpr u32 command_hash(u32 seed, string_view name) {
+    u32 hash = 2166136261u ^ seed;
+    for (char c : name) hash = (hash ^ (u8) c) * 16777619u;
+    return (hash ^ (hash >> 15)) % command_slots;
+}
+
+struct CommandTable {
+    u32 seed = 0;
+    u8 slot[command_slots] = {};
+};
+
+constexpr CommandTable make_command_table() {
+    CommandTable table;
+    for (u32 seed = 1;; seed++) {
+        bool clash = false;
+        for (u32 i = 0; i < command_slots; i++) table.slot[i] = CMD_OTHER;
+        for (u32 c = 0; c < CMD_OTHER && !clash; c++) {
+            u32 h = command_hash(seed, command_names[c]);
+            clash = table.slot[h] != CMD_OTHER;
+            table.slot[h] = c;
+        }
+        if (!clash) {
+            table.seed = seed;
+            return table;
+        }
+    }
+}
+
+constexpr CommandTable command_table = make_command_table();
+
+inline Command command_of(string_view msg) {
+    msg = msg.substr(0, msg.find(','));
+    u32 c = command_table.slot[command_hash(command_table.seed, msg)];
+    return command_names[c] == msg ? (Command) c : CMD_OTHER;
+}
+
+
+//
+// Fields
+//
+
+// Fields are written with to_chars straight into the caller's buffer, so a
+// buffer that is cleared and reused stops allocating once it has grown.
+
+template <class T>
+inline void put_field(string &out, const T &value) {
+    out += ',';
+    if constexpr (is_same<T, bool>::value) {
+        out += value ? '1' : '0';
+    } else if constexpr (is_integral<T>::value) {
+        char digits[24];
+        auto res = to_chars(digits, digits + sizeof(digits), value);
+        out.append(digits, res.ptr);
+    } else {
+        out += value;
+    }
+}
+
+// Reads the fields after a command name. A missing or malformed field is a
+// bad request; trailing fields nobody asked for are ignored.
+struct Args {
+    string_view rest;
+
+    inline bool more() const {
+        return !rest.empty();
+    }
+
+    inline string_view next_text() {
+        if (rest.size() < 2 || rest[0] != ',') throw "bad request";
+        u64 end = rest.find(',', 1);
+        string_view field = rest.substr(1, end == string::npos ? string::npos : end - 1);
+        rest = end == string::npos ? string_view() : rest.substr(end);
+        if (field.empty()) throw "bad request";
+        return field;
+    }
+
+    template <class T>
+    inline T next() {
+        string_view field = next_text();
+        if constexpr (is_same<T, string_view>::value) {
+            return field;
+        } else if constexpr (is_same<T, string>::value) {
+            return string(field);
+        } else if constexpr (is_same<T, bool>::value) {
+            return next_number<i32>(field) != 0;
+        } else {
+            return next_number<T>(field);
+        }
+    }
+
+    template <class T>
+    static inline T next_number(string_view field) {
+        T value;
+        auto res = from_chars(field.data(), field.data() + field.size(), value);
+        if (res.ec != errc() || res.ptr != field.data() + field.size()) throw "bad request";
+        return value;
+    }
+};
+
+
+//
+// Layouts
+//
+
+// The fields of a message, in wire order. Members are taken from the object
+// being encoded; a pointer to a global is written as is.
+template <auto... Members>
+struct Fields {
+    template <class T>
+    static inline void encode(string &out, const T &value) {
+        (put_member<Members>(out, value), ...);
+    }
+
+    template <class T>
+    static inline void decode(Args &in, T &value) {
+        (get_member<Members>(in, value), ...);
+    }
+
+    template <auto Member, class T>
+    static inline void put_member(string &out, const T &value) {
+        if constexpr (is_member_pointer<decltype(Member)>::value) {
+            put_field(out, value.*Member);
+        } else {
+            put_field(out, *Member);
+        }
+    }
+
+    template <auto Member, class T>
+    static inline void get_member(Args &in, T &value) {
+        if constexpr (is_member_pointer<decltype(Member)>::value) {
+            value.*Member = in.next<remove_reference_t<decltype(value.*Member)>>();
+        } else {
+            *Member = in.next<remove_reference_t<decltype(*Member)>>();
+        }
+    }
+};
+
+// Loose values that don't live in any one object.
+template <class... Types>
+struct Values {
+    static inline void encode(string &out, const Types&... values) {
+        (put_field(out, values), ...);
+    }
+};
+
+// Several layouts back to back, each fed from its own object.
+template <class... Parts>
+struct Chain {
+    template <class... T>
+    static inline void encode(string &out, const T&... values) {
+        (Parts::encode(out, values), ...);
+    }
+};
+
+template <Command C, class Layout>
+struct Message {
+    static constexpr Command command = C;
+    using layout = Layout;
+};
+
+template <class Msg, class... T>
+inline void encode(string &out, const T&... values) {
+    out += command_names[Msg::command];
+    Msg::layout::encode(out, values...);
+}
+
+// Encodes onto the end of a frame that may already hold other messages.
+template <class Msg, class... T>
+inline void append(string &out, const T&... values) {
+    if (!out.empty()) out += ';';
+    encode<Msg>(out, values...);
+}
+
+template <class Msg, class T>
+inline void decode(Args &in, T &value) {
+    Msg::layout::decode(in, value);
+}
+
+
+//
+// Schema
+//
+
+struct Stamped {
+    u64 stamp;
+};
+
+struct JoinRequest {
+    string_view nick;
+};
+
+struct SteerRequest {
+    i32 id, x, y, angle;
+};
+
+using ShipFields = Fields<&Player::id, &Player::x, &Player::y, &Player::angle, &Player::spice, &Player::energy, &Player::shield, &Player::game_over>;
+using GameFields = Fields<&map_size, &Game::until_reset, &Game::until_stop, &Game::finished, &Game::clock>;
+using SteerFields = Fields<&SteerRequest::id, &SteerRequest::x, &SteerRequest::y, &SteerRequest::angle>;
+
+// Either side may stamp a ping with its own clock, the other side echoes the
+// stamp back in the pong. Unstamped pings get a bare pong.
+using Ping = Message<CMD_PING, Fields<&Stamped::stamp>>;
+using Pong = Message<CMD_PONG, Fields<&Stamped::stamp>>;
+using BarePong = Message<CMD_PONG, Values<>>;
+using Join = Message<CMD_JOIN, Fields<&JoinRequest::nick>>;
+using Joined = Message<CMD_JOIN, Chain<ShipFields, GameFields>>;
+using UsrCoord = Message<CMD_USR_COORD, SteerFields>;
+using UsrFired = Message<CMD_USR_FIRED, SteerFields>;
+
+using StatGame = Message<CMD_STAT_GAME, GameFields>;
+using StatShip = Message<CMD_STAT_SHIP, ShipFields>;
+using StatRock = Message<CMD_STAT_ROCK, Fields<&Rock::id, &Rock::x, &Rock::y, &Rock::angle, &Rock::speed, &Rock::size, &Rock::health>>;
+using StatBullet = Message<CMD_STAT_BULLET, Fields<&Bullet::id, &Bullet::pid, &Bullet::x, &Bullet::y, &Bullet::angle, &Bullet::time>>;
+using StatPellet = Message<CMD_STAT_PELLET, Fields<&Pellet::id, &Pellet::x, &Pellet::y, &Pellet::value, &Pellet::type>>;
+using NewRock = Message<CMD_NEW_ROCK, Fields<&Rock::id, &Rock::x0, &Rock::y0, &Rock::t0, &Rock::angle, &Rock::speed, &Rock::size, &Rock::health>>;
+using NewBullet = Message<CMD_NEW_BULLET, Fields<&Bullet::id, &Bullet::pid, &Bullet::x0, &Bullet::y0, &Bullet::t0, &Bullet::angle>>;
+// clock, rock count, rock id sum, bullet count, bullet id sum
+using SumWorld = Message<CMD_SUM_WORLD, Values<i32, u64, u32, u64, u32>>;
+// Leads each chunk of a relay's resync, with the entities still to come, so
+// the relay can pass it on to only the viewers waiting for it.
+using SyncWorld = Message<CMD_SYNC_WORLD, Values<u64>>;
+
+using DelShip = Message<CMD_DEL_SHIP, Values<i32>>;
+using DelRock = Message<CMD_DEL_ROCK, Values<i32>>;
+using DelBullet = Message<CMD_DEL_BULLET, Values<i32>>;
+using DelPellet = Message<CMD_DEL_PELLET, Values<i32>>;
+
+using LogJoin = Message<CMD_LOG_JOIN, Values<string_view>>;
+using LogLeft = Message<CMD_LOG_LEFT, Values<string_view>>;
+using LogDead = Message<CMD_LOG_DEAD, Values<string_view>>;
+using LogWin = Message<CMD_LOG_WIN, Values<string_view>>;
+using GameOver = Message<CMD_GAME_OVER, Values<i32>>;
+using GotHit = Message<CMD_GOT_HIT, Values<>>;
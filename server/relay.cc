@@ -0,0 +1,356 @@
+#include <unordered_set>
+#include <string_view>
+
+#include "util.hh"
+
+using namespace std;
+
+// A relay subscribes to one game server (or another relay) as a single
+// connection and fans the frame stream out to any number of read-only
+// viewers, so watchers cost the game server nothing.
+
+// ----------------------------------------------------------------------------
+// -- Global data
+// ----------------------------------------------------------------------------
+
+i32 port = 6667;
+string upstream_host = "127.0.0.1";
+i32 upstream_port = 6666;
+// Sent with our subscription, and asked of relays chained to us from other
+// machines.
+string token;
+
+NicePoll nicepoll;
+unordered_set<i32> viewers;
+map<i32, u64> last_ping;
+
+i32 upstream = -1;
+bool upstream_ready = false;
+string upstream_buffer;
+u64 last_connect = 0;
+u64 last_upstream_ping = 0;
+
+// Connecting doesn't block the viewers, but gives up after this long.
+const u64 CONNECT_TIMEOUT = 3*1000;
+
+// Viewers joining late need a fresh copy of the world, which the upstream
+// sends again whenever we ask; at most once a second though. Viewers wait
+// until the next resync starts, and only the ones it was asked for get it.
+const u64 RESYNC_PERIOD = 1000;
+// A resync that hasn't finished by then is given up on.
+const u64 RESYNC_TIMEOUT = 10*1000;
+unordered_set<i32> waiting, syncing;
+u64 last_resync = 0;
+
+// Latest stat message per entity ("rock,12" -> "stat-rock,12,..."), replayed
+// to new viewers straight away while the resync is on its way.
+map<string, string> mirror;
+i64 mirror_clock = 0;
+
+// Largest upstream line we're willing to buffer.
+const u64 max_line = 1 << 20;
+
+
+// ----------------------------------------------------------------------------
+// -- Mirror
+// ----------------------------------------------------------------------------
+
+void remember(string_view msg) {
+    u64 comma = msg.find(',');
+    string_view kind = msg.substr(0, comma);
+    string_view rest = comma == string::npos ? string_view() : msg.substr(comma + 1);
+    string_view id = rest.substr(0, rest.find(','));
+
+    if (kind == "stat-game") {
+        // A new match restarts the clock and reuses ids, forget the old one.
+        u64 last = msg.rfind(',');
+        i64 clock = atoll(string(msg.substr(last + 1)).c_str());
+        if (clock < mirror_clock) mirror.clear();
+        mirror_clock = clock;
+        mirror["game"] = string(msg);
+
+    } else if (kind.compare(0, 5, "stat-") == 0) {
+        mirror[string(kind.substr(5)) + "," + string(id)] = string(msg);
+
+    } else if (kind.compare(0, 4, "del-") == 0) {
+        mirror.erase(string(kind.substr(4)) + "," + string(id));
+    }
+}
+
+void send_mirror(i32 fd) {
+    const u64 chunk = 8*1024;
+    string res;
+    for (auto const& [key, msg] : mirror) {
+        if (!res.empty()) res += ";";
+        res += msg;
+        if (res.size() >= chunk) {
+            xsend(fd, res);
+            res.clear();
+        }
+    }
+    if (!res.empty()) xsend(fd, res);
+}
+
+
+// ----------------------------------------------------------------------------
+// -- Upstream
+// ----------------------------------------------------------------------------
+
+void drop_upstream() {
+    if (upstream_ready) printf("[warn] lost upstream %s:%d\n", upstream_host.c_str(), upstream_port);
+    nicepoll.erase(upstream);
+    xclear(upstream);
+    upstream = -1;
+    upstream_ready = false;
+    upstream_buffer.clear();
+    mirror.clear();
+    mirror_clock = 0;
+    for (i32 fd : syncing) waiting.insert(fd);
+    syncing.clear();
+}
+
+void request_resync() {
+    last_resync = millis();
+    syncing.insert(waiting.begin(), waiting.end());
+    waiting.clear();
+    xsend(upstream, token.empty() ? "conn,relay" : "conn,relay," + token);
+}
+
+// The upstream's stamped pings measure the link to us, answer them here
+// instead of passing them on.
+void forward(const string &line) {
+    if (line.compare(0, 5, "ping,") == 0) {
+        xsend(upstream, "pong" + line.substr(4));
+        return;
+    }
+    u64 start = 0;
+    while (start <= line.size()) {
+        u64 end = line.find(';', start);
+        if (end == string::npos) end = line.size();
+        remember(string_view(line.data() + start, end - start));
+        start = end + 1;
+    }
+
+    // Resync chunks lead with how much of the world is still to come.
+    if (line.compare(0, 11, "sync-world,") == 0) {
+        for (i32 fd : syncing) xsend(fd, line);
+        if (atoll(line.c_str() + 11) == 0) syncing.clear();
+        return;
+    }
+    for (i32 fd : viewers) xsend(fd, line);
+}
+
+void handle_upstream(i32 fd, u32 events) {
+    if (events & EPOLLIN) {
+        char buffer[64*1024];
+        i64 length;
+        while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+            upstream_buffer.append(buffer, length);
+        }
+        if (length == 0) {
+            drop_upstream();
+            return;
+        }
+
+        u64 start = 0, end;
+        while ((end = upstream_buffer.find('\n', start)) != string::npos) {
+            forward(upstream_buffer.substr(start, end - start));
+            start = end + 1;
+        }
+        upstream_buffer.erase(0, start);
+        if (upstream_buffer.size() > max_line) upstream_buffer.clear();
+    }
+    if (events & ~EPOLLIN) {
+        drop_upstream();
+    }
+}
+
+// The connection is writable once it's established, or failed.
+void handle_connecting(i32 fd, u32 events) {
+    i32 error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0 || (events & ~EPOLLOUT)) {
+        drop_upstream();
+        return;
+    }
+
+    printf("[info] relaying %s:%d\n", upstream_host.c_str(), upstream_port);
+    upstream_ready = true;
+    last_upstream_ping = millis();
+    nicepoll.modify(fd, EPOLLIN | EPOLLRDHUP, &handle_upstream);
+    // Everyone watching needs the world we're about to mirror.
+    waiting.insert(viewers.begin(), viewers.end());
+    request_resync();
+}
+
+void connect_upstream() {
+    last_connect = millis();
+    i32 fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return;
+
+    sockaddr_in addr{AF_INET, htons(upstream_port), {}};
+    if (inet_pton(AF_INET, upstream_host.c_str(), &addr.sin_addr) != 1 ||
+        make_nonblocking(fd) < 0 ||
+        (connect(fd, (sockaddr*) &addr, sizeof(addr)) < 0 && errno != EINPROGRESS)) {
+        close(fd);
+        return;
+    }
+
+    upstream = fd;
+    nicepoll.insert(fd, EPOLLOUT, &handle_connecting);
+}
+
+void service_upstream() {
+    u64 time = millis();
+    if (upstream < 0) {
+        if (time - last_connect >= 1000) connect_upstream();
+        return;
+    }
+    if (!upstream_ready) {
+        if (time - last_connect >= CONNECT_TIMEOUT) drop_upstream();
+        return;
+    }
+    if (time - last_upstream_ping >= 1000) {
+        last_upstream_ping = time;
+        xsend(upstream, "ping");
+    }
+    if (!syncing.empty() && time - last_resync >= RESYNC_TIMEOUT) syncing.clear();
+    if (!waiting.empty() && syncing.empty() && time - last_resync >= RESYNC_PERIOD) request_resync();
+    if (!xflush(upstream)) drop_upstream();
+}
+
+
+// ----------------------------------------------------------------------------
+// -- Viewers
+// ----------------------------------------------------------------------------
+
+void remove_viewer(i32 fd) {
+    printf("[info] removing viewer %d\n", fd);
+    nicepoll.erase(fd);
+    viewers.erase(fd);
+    waiting.erase(fd);
+    syncing.erase(fd);
+    last_ping.erase(fd);
+    xclear(fd);
+}
+
+void prune_viewers() {
+    vector<i32> to_remove;
+    for (auto const& [fd, time] : last_ping) {
+        if (millis() - time > 10*1000 || !xflush(fd))
+            to_remove.push_back(fd);
+    }
+    for (i32 fd : to_remove) {
+        remove_viewer(fd);
+    }
+}
+
+// Viewers are read-only: they get answers to pings, and chained relays can
+// ask for a resync, everything else is dropped. Like the game server, only
+// relays on this machine or holding our token may.
+void handle_viewer(i32 fd, u32 events) {
+    if (events & EPOLLIN) {
+        last_ping[fd] = millis();
+        for (string req : xrecv(fd)) {
+            if (req.compare(0, 4, "ping") == 0) {
+                xsend(fd, "pong");
+            } else if (req.compare(0, 10, "conn,relay") == 0) {
+                bool allowed = is_loopback(fd) || (!token.empty() && req == "conn,relay," + token);
+                if (allowed && syncing.count(fd) == 0) waiting.insert(fd);
+            }
+        }
+    }
+    if (events & ~EPOLLIN) {
+        remove_viewer(fd);
+    }
+}
+
+void handle_server(i32 fd, u32 events) {
+    if (events & EPOLLIN) {
+        sockaddr_in client_addr{};
+        socklen_t client_len = sizeof(client_addr);
+
+        i32 client = accept(fd, (sockaddr*) &client_addr, &client_len);
+        if (client < 0) {
+            cerr << "[warn] couldn't connect to viewer" << endl;
+            return;
+        }
+        if (make_nonblocking(client) < 0) {
+            close(client);
+            return;
+        }
+
+        char *addr = inet_ntoa(client_addr.sin_addr);
+        printf("[info] new viewer from: %s:%hu (fd: %d)\n", addr, ntohs(client_addr.sin_port), client);
+
+        viewers.insert(client);
+        last_ping[client] = millis();
+        nicepoll.insert(client, EPOLLIN | EPOLLRDHUP, &handle_viewer);
+        send_mirror(client);
+        waiting.insert(client);
+    }
+}
+
+
+// ----------------------------------------------------------------------------
+// -- Entry point
+// ----------------------------------------------------------------------------
+
+void parse_args(int argc, char **argv) {
+    for (i32 i = 1; i < argc - 1; i++) {
+        if (strcmp(argv[i],"-p")==0 || strcmp(argv[i],"--port")==0) {
+            port = atoi(argv[++i]);
+
+        } else if (strcmp(argv[i],"-u")==0 || strcmp(argv[i],"--upstream")==0) {
+            string arg = argv[++i];
+            u64 colon = arg.find(':');
+            if (colon == string::npos) fatal("upstream should be HOST:PORT");
+            upstream_host = arg.substr(0, colon);
+            upstream_port = atoi(arg.substr(colon + 1).c_str());
+
+        } else if (strcmp(argv[i],"-t")==0 || strcmp(argv[i],"--token")==0) {
+            token = argv[++i];
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    const i32 max_pending = 32;
+    const u32 max_events = 8;
+
+    if (argc < 2) {
+        printf("usage: %s --upstream HOST:PORT -p PORT [--token TOKEN]\n", argv[0]);
+        exit(1);
+    }
+    parse_args(argc, argv);
+
+    i32 server = socket(AF_INET, SOCK_STREAM, 0);
+    if (server < 0)
+        fatal("could not create socket");
+
+    if (make_reusable(server) < 0 || make_nonblocking(server) < 0)
+        fatal("could not configure socket");
+
+    sockaddr_in addr{AF_INET, htons(port), {INADDR_ANY}};
+    if (bind(server, (sockaddr*) &addr, sizeof(addr)) < 0)
+        fatal("could not bind socket");
+
+    if (listen(server, max_pending) < 0)
+        fatal("could not listen on socket");
+
+    printf("[info] listening on port %d\n", port);
+    if (nicepoll.create() < 0)
+        fatal("could not create epoll descriptor");
+
+    nicepoll.insert(server, EPOLLIN, &handle_server);
+
+    epoll_event events[max_events];
+    while (true) {
+        i32 event_count = nicepoll.wait(events, 1, 10);
+        for (i32 i = 0; i < event_count; i++) {
+            nicepoll.handle(events[i]);
+        }
+        service_upstream();
+        prune_viewers();
+    }
+}
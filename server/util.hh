@@ -9,6 +9,8 @@
 #include <vector>
 #include <stack>
 #include <map>
+#include <deque>
+#include <unordered_set>
 
 #include <memory>
 #include <algorithm>
@@ -24,10 +26,14 @@
 #include <fcntl.h>
 #include <sys/types.h> 
 #include <sys/socket.h> 
+#include <sys/un.h> 
 #include <sys/epoll.h> 
+#include <sys/time.h> 
 #include <sys/ioctl.h> 
 #include <arpa/inet.h> 
 #include <netinet/in.h> 
+#include <netinet/tcp.h> 
+#include <linux/sockios.h> 
 
 #include <string>
 #include <map>
@@ -52,6 +58,7 @@ typedef int8_t  i8;
 typedef int16_t i16;
 typedef int32_t i32;
 typedef int64_t i64;
+typedef __int128 i128;
 
 typedef uint8_t  u8;
 typedef uint16_t u16;
@@ -142,6 +149,30 @@ inline i32 random_uniform(i32 lower, i32 upper) {
     return dist(gen);
 }
 
+// Tiny seeded generator (splitmix64) for procedural content that has to come
+// out the same every time, cheap enough to keep one per region.
+struct SplitMix {
+    u64 state;
+
+    inline u64 next() {
+        u64 z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    inline i32 uniform(i32 lower, i32 upper) {
+        return lower + (i32)(next() % (u64)(upper - lower + 1));
+    }
+
+    // Irwin-Hall approximation, integer only.
+    inline i32 normal(i32 mean, i32 std) {
+        i64 sum = 0;
+        for (i32 i = 0; i < 12; i++) sum += uniform(0, 999);
+        return mean + (sum - 5994) * std / 1000;
+    }
+};
+
 //
 // Time
 //
@@ -154,6 +185,10 @@ inline u64 millis() {
     return now().time_since_epoch().count() / 1e6;
 }
 
+inline u64 micros() {
+    return now().time_since_epoch().count() / 1000;
+}
+
 template <class T>
 inline u64 millis(T delta) {
     return chrono::duration_cast<chrono::milliseconds>(delta).count();
@@ -185,8 +220,9 @@ inline vector<string> split(string str, string token) {
 
 inline vector<string> split(i32 n, string str, string token) {
     auto res = split(str, token);
+    if ((i32)res.size() < n) throw "bad request";
     for (i32 i = 0; i < n; i++) {
-        if (res[i] == "") throw;
+        if (res[i] == "") throw "bad request";
     }
     return res;
 }
@@ -234,6 +270,28 @@ struct Table {
     }
 };
 
+// Allows rate tokens per second with bursts of up to burst tokens. Tokens are
+// kept in thousandths so refilling works in whole millis.
+struct TokenBucket {
+    i32 rate = 0;
+    i32 burst = 0;
+    i64 tokens = 0;
+    u64 last = 0;
+
+    inline TokenBucket() = default;
+
+    inline TokenBucket(i32 rate, i32 burst, u64 time)
+        : rate(rate), burst(burst), tokens((i64)burst * 1000), last(time) {}
+
+    inline bool take(u64 time) {
+        tokens = min(tokens + (i64)(time - last) * rate, (i64)burst * 1000);
+        last = time;
+        if (tokens < 1000) return false;
+        tokens -= 1000;
+        return true;
+    }
+};
+
 
 //
 // File
@@ -279,6 +337,14 @@ struct NicePoll {
         epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
     }
 
+    inline void modify(i32 fd, u32 events, void (*callback)(i32, u32)) {
+        epoll_event event;
+        event.events = events;
+        event.data.fd = fd;
+        handlers[fd] = callback;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+    }
+
     inline void erase(i32 fd) {
         epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
         handlers.erase(fd);
@@ -296,6 +362,60 @@ struct NicePoll {
     }
 };
 
+inline i32 unix_socket(const string &path, sockaddr_un &addr) {
+    addr = sockaddr_un{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, path.c_str());
+    return socket(AF_UNIX, SOCK_STREAM, 0);
+}
+
+// The kernel caps descriptors per message (SCM_MAX_FD), so they go in batches.
+const u32 max_passed_fds = 250;
+
+inline bool send_fds(i32 sock, const vector<i32> &fds) {
+    for (u64 start = 0; start < fds.size() || start == 0; start += max_passed_fds) {
+        u32 count = min<u64>(fds.size() - start, max_passed_fds);
+        char control[CMSG_SPACE(sizeof(i32) * max_passed_fds)] = {};
+        iovec iov{&count, sizeof(count)};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if (count > 0) {
+            msg.msg_control = control;
+            msg.msg_controllen = CMSG_SPACE(sizeof(i32) * count);
+            cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(i32) * count);
+            memcpy(CMSG_DATA(cmsg), fds.data() + start, sizeof(i32) * count);
+        }
+        if (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0) return false;
+        if (fds.empty()) break;
+    }
+    return true;
+}
+
+// Receives one batch sent by send_fds and appends it to fds.
+inline bool recv_fds(i32 sock, vector<i32> &fds) {
+    u32 count = 0;
+    char control[CMSG_SPACE(sizeof(i32) * max_passed_fds)] = {};
+    iovec iov{&count, sizeof(count)};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(sock, &msg, MSG_WAITALL) != sizeof(count)) return false;
+    if (count == 0) return true;
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == nullptr || cmsg->cmsg_type != SCM_RIGHTS) return false;
+    u64 start = fds.size();
+    fds.resize(start + count);
+    memcpy(fds.data() + start, CMSG_DATA(cmsg), sizeof(i32) * count);
+    return true;
+}
+
 inline i32 make_reusable(i32 fd) {
     const i32 one = 1;
     return setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
@@ -306,27 +426,142 @@ inline i32 make_nonblocking(i32 fd) {
     return ioctl(fd, FIONBIO, &one);
 }
 
+// Whether the peer on the other end connected from this machine.
+inline bool is_loopback(i32 fd) {
+    sockaddr_in addr{};
+    socklen_t length = sizeof(addr);
+    if (getpeername(fd, (sockaddr*) &addr, &length) < 0 || addr.sin_family != AF_INET) return false;
+    return ntohl(addr.sin_addr.s_addr) >> 24 == 127;
+}
+
+// Whether the peer on a UNIX socket runs as the same user we do.
+inline bool is_same_user(i32 fd) {
+    ucred cred{};
+    socklen_t length = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &length) < 0) return false;
+    return cred.uid == getuid();
+}
 
 map<i32, string> inbox;
+map<i32, string> outbox;
+// Bytes ever handed to xsend per fd. Against two looks at xqueued, it
+// tells how much the link drained in between.
+map<i32, u64> outbox_total;
+
+// Clients are non-blocking, so whatever the kernel doesn't take right away
+// waits in the outbox until the next flush.
+const u64 max_outbox = 4 << 20;
+
+// Called once the last byte of a frame has been written, with the micros it
+// spent queued. Frames are only stamped while this is set.
+void (*xwrite_hook)(i32 fd, u64 waited) = nullptr;
+
+// When each queued frame was handed to xsend, by the count of bytes ever
+// queued on the fd just past its end. The counts only grow, so a write
+// only has to look at the frames it finishes.
+struct Stamp {
+    u64 end;
+    u64 time;
+};
+
+struct Stamps {
+    u64 queued = 0;
+    u64 written = 0;
+    deque<Stamp> frames;
+};
 
-inline void xsend(i32 fd, string x) {
-    x += "\n";
-    const char *buffer = x.c_str();
-    u32 length = x.size();
-    u32 written = 0;
-    while (written < length)
-        written += write(fd, buffer + written, length - written);
+map<i32, Stamps> outbox_stamps;
+
+inline void xwritten(i32 fd, u64 written) {
+    auto it = outbox_stamps.find(fd);
+    if (it == outbox_stamps.end()) return;
+    Stamps &stamps = it->second;
+    stamps.written += written;
+    u64 time = micros();
+    while (!stamps.frames.empty() && stamps.frames.front().end <= stamps.written) {
+        xwrite_hook(fd, time - stamps.frames.front().time);
+        stamps.frames.pop_front();
+    }
+    if (stamps.frames.empty()) outbox_stamps.erase(it);
 }
 
-inline vector<string> xrecv(i32 fd) {
+inline bool xflush(i32 fd) {
+    auto it = outbox.find(fd);
+    if (it == outbox.end()) return true;
+    string &x = it->second;
+    u64 written = 0;
+    while (written < x.size()) {
+        // A peer that hung up must cost us the connection, not the process.
+        i64 n = send(fd, x.data() + written, x.size() - written, MSG_NOSIGNAL);
+        if (n <= 0) break;
+        written += n;
+    }
+    if (xwrite_hook && written > 0) xwritten(fd, written);
+    x.erase(0, written);
+    u64 left = x.size();
+    if (left == 0) outbox.erase(it);
+    return left <= max_outbox;
+}
+
+inline void xsend(i32 fd, const string &x) {
+    if (fd < 0) return;
+    string &pending = outbox[fd];
+    pending += x;
+    pending += "\n";
+    outbox_total[fd] += x.size() + 1;
+    if (xwrite_hook) {
+        Stamps &stamps = outbox_stamps[fd];
+        stamps.queued += x.size() + 1;
+        stamps.frames.push_back({stamps.queued, micros()});
+    }
+    xflush(fd);
+}
+
+// Bytes accepted by xsend that the peer hasn't acknowledged yet, counting
+// both our outbox and the kernel send buffer.
+inline u64 xqueued(i32 fd) {
+    i32 unsent = 0;
+    ioctl(fd, SIOCOUTQ, &unsent);
+    auto it = outbox.find(fd);
+    return (it == outbox.end() ? 0 : it->second.size()) + max(unsent, 0);
+}
+
+// Has the kernel stamp everything it receives on fd, see xrecv.
+inline i32 make_timestamped(i32 fd) {
+    const i32 one = 1;
+    return setsockopt(fd, SOL_SOCKET, SO_TIMESTAMP, &one, sizeof(one));
+}
+
+// On a timestamped socket, arrived gets the micros at which the newest of the
+// bytes read reached the kernel, and the time of the read otherwise.
+inline vector<string> xrecv(i32 fd, u64 *arrived = nullptr) {
     const i32 max_length = 1024;
     u8 buffer[max_length];
     vector<string> reqs;
 
-    i32 length = read(fd, buffer, max_length);
+    iovec iov{buffer, max_length};
+    char control[CMSG_SPACE(sizeof(timeval))] = {};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    i32 length = recvmsg(fd, &msg, 0);
     if (length <= 0) {
         return reqs;
     }
+    if (arrived) {
+        *arrived = micros();
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMP) {
+            // The kernel stamps with the real-time clock.
+            timeval stamp, wall;
+            memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+            gettimeofday(&wall, nullptr);
+            i64 waited = (i64)(wall.tv_sec - stamp.tv_sec) * 1000000 + (wall.tv_usec - stamp.tv_usec);
+            *arrived -= min<u64>(max<i64>(waited, 0), *arrived);
+        }
+    }
     
     string chunk(buffer, buffer + length);
     if (inbox.find(fd) != inbox.end()) {
@@ -336,9 +571,15 @@ inline vector<string> xrecv(i32 fd) {
     vector<string> msgs = split(chunk, "\n");
     inbox[fd] = msgs.back();
     msgs.pop_back();
+
+    // Nobody sends lines this long, drop the partial one instead of growing.
+    if (inbox[fd].size() > max_length * 4) inbox[fd].clear();
     return msgs;
 }
 
 inline void xclear(i32 fd) {
     inbox.erase(fd);
+    outbox.erase(fd);
+    outbox_total.erase(fd);
+    outbox_stamps.erase(fd);
 }